@@ -0,0 +1,327 @@
+/*
+ * Micro-benchmarks for the sonos protocol layer, run against the fake household in fake_network.h
+ * with the payloads in host/payloads. Reports time and heap traffic per call, allocations made by
+ * the fake network itself are left out. Every operation is also held to its memory budget from
+ * sonos_memory.cpp, and the exit status is 1 if any call went over.
+ *
+ *   sonos_bench [filter]    only run benchmarks whose name contains filter
+ */
+#include <Arduino.h>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <thread>
+#include "fake_network.h"
+#include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_memory.h"
+#include "sonos_rtt.h"
+#include "sonos_topology.h"
+#include "sonos_xml.h"
+#include "soap.h"
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static bool counting = false;
+static unsigned long allocations = 0;
+static unsigned long allocatedBytes = 0;
+
+static void countAllocation(size_t size) {
+    if (fakeNetworkBusy != 0) {
+        return;
+    }
+    if (counting) {
+        allocations++;
+        allocatedBytes += size;
+    }
+    memoryCountAllocation(size);
+}
+
+// expat and the rest of the C side allocate through malloc, and so does operator new
+extern "C" void *malloc(size_t size) {
+    countAllocation(size);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    countAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+    countAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+// The garage player, grouped with the kitchen as coordinator in the large topology
+#define GARAGE_UUID "RINCON_000E58A0B1C201400"
+static const IPAddress GARAGE(192, 168, 1, 20);
+// Last player in the large topology
+#define KIDS_ROOM_UUID "RINCON_000E58A0B1CD01400"
+
+static std::string payload(const char *name) {
+    std::ifstream file(std::string(PAYLOAD_DIR) + "/" + name);
+    if (!file) {
+        fprintf(stderr, "Missing payload %s\n", name);
+        exit(1);
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return contents.str();
+}
+
+static std::string volumeResponse;
+static std::string relativeVolumeResponse;
+static std::string transportResponse;
+static std::string emptyResponse;
+static std::string smallTopologyResponse;
+static std::string largeTopologyResponse;
+static const std::string *topologyResponse;
+// What a player that isn't its group's coordinator says to a transport action
+static std::string notCoordinatorResponse;
+// Answers transport actions with notCoordinatorResponse, like a coordinator that has left the group since we read the topology
+static IPAddress staleCoordinator;
+
+static std::string answer(const FakeRequest &request) {
+    const std::string &action = request.soapAction;
+    if (request.host == staleCoordinator && action.find("AVTransport") != std::string::npos) {
+        return notCoordinatorResponse;
+    } else if (action.find("#GetVolume") != std::string::npos) {
+        return volumeResponse;
+    } else if (action.find("#SetRelativeVolume") != std::string::npos) {
+        return relativeVolumeResponse;
+    } else if (action.find("#GetTransportInfo") != std::string::npos) {
+        return transportResponse;
+    } else if (action.find("#GetZoneGroupState") != std::string::npos) {
+        return *topologyResponse;
+    }
+    return emptyResponse;
+}
+
+static const char *filter = NULL;
+
+static void bench(const char *name, std::function<void()> run) {
+    if (filter != NULL && strstr(name, filter) == NULL) {
+        return;
+    }
+    for (int i = 0; i < 10; i++) {
+        run();
+    }
+
+    allocations = 0;
+    allocatedBytes = 0;
+    unsigned long iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::nanoseconds(0);
+    counting = true;
+    while (elapsed < std::chrono::milliseconds(200) || iterations < 100) {
+        run();
+        iterations++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    counting = false;
+
+    printf("%-40s %10lu %12.0f %10.1f %12.1f\n", name, iterations,
+        (double) elapsed.count() / iterations,
+        (double) allocations / iterations,
+        (double) allocatedBytes / iterations);
+}
+
+static boolean countMember(const ZoneGroupMember &member, void *data) {
+    (*(int *) data)++;
+    return true;
+}
+
+static boolean stopAtMember(const ZoneGroupMember &member, void *data) {
+    return strcmp(member.uuid, (const char *) data) != 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    volumeResponse = fakeResponse(200, payload("get_volume.xml"));
+    relativeVolumeResponse = fakeResponse(200, payload("set_relative_volume.xml"));
+    transportResponse = fakeResponse(200, payload("get_transport_info.xml"));
+    emptyResponse = fakeResponse(200, payload("empty_response.xml"));
+    smallTopologyResponse = fakeResponse(200, payload("zone_group_state_small.xml"));
+    largeTopologyResponse = fakeResponse(200, payload("zone_group_state_large.xml"));
+    topologyResponse = &largeTopologyResponse;
+    notCoordinatorResponse = fakeResponse(500,
+        "<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body><s:Fault>"
+        "<faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"
+        "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>800</errorCode></UPnPError>"
+        "</detail></s:Fault></s:Body></s:Envelope>");
+
+    fakeNetwork.handler = answer;
+    fakeNetwork.ssdpResponder = IPAddress(192, 168, 1, 22);
+
+    static constexpr SoapTemplate SET_RELATIVE_VOLUME = SOAP_TEMPLATE("/MediaRenderer/RenderingControl/Control", "RenderingControl", "SetRelativeVolume",
+        "<InstanceID>0</InstanceID><Channel>Master</Channel>", "Adjustment");
+    static constexpr SoapAction GET_VOLUME = SOAP_ACTION("/MediaRenderer/RenderingControl/Control", "RenderingControl", "GetVolume",
+        "<InstanceID>0</InstanceID><Channel>Master</Channel>");
+    static constexpr SoapAction GET_ZONE_GROUP_STATE = SOAP_ACTION("/ZoneGroupTopology/Control", "ZoneGroupTopology", "GetZoneGroupState", "");
+
+    // Fill the topology so the operations know the garage's coordinator
+    sonosTopologyRefresh(fakeNetwork.ssdpResponder, GARAGE_UUID);
+
+    printf("%-40s %10s %12s %10s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op", "bytes/op");
+
+    bench("soapFill SetRelativeVolume", [] {
+        char body[SOAP_MAX_BODY];
+        soapFill(SET_RELATIVE_VOLUME, -7, body);
+    });
+
+    bench("post GetVolume, finish", [] {
+        SonosConnection *conn = sonosConnection(GARAGE);
+        conn->post(GET_VOLUME);
+        conn->finish();
+    });
+    bench("post GetVolume, xmlTagValue", [] {
+        SonosConnection *conn = sonosConnection(GARAGE);
+        conn->post(GET_VOLUME);
+        char volume[8];
+        xmlTagValue(conn, "CurrentVolume", volume, sizeof(volume));
+        conn->finish();
+    });
+
+    bench("xmlZoneGroupMembers large, first", [] {
+        SonosConnection *conn = sonosConnection(GARAGE);
+        conn->post(GET_ZONE_GROUP_STATE);
+        xmlZoneGroupMembers(conn, stopAtMember, (void *) "RINCON_000E58A0B1C301400");
+        conn->finish();
+    });
+    bench("xmlZoneGroupMembers large, last", [] {
+        SonosConnection *conn = sonosConnection(GARAGE);
+        conn->post(GET_ZONE_GROUP_STATE);
+        xmlZoneGroupMembers(conn, stopAtMember, (void *) KIDS_ROOM_UUID);
+        conn->finish();
+    });
+    bench("xmlZoneGroupMembers large, all", [] {
+        SonosConnection *conn = sonosConnection(GARAGE);
+        conn->post(GET_ZONE_GROUP_STATE);
+        int count = 0;
+        xmlZoneGroupMembers(conn, countMember, &count);
+        conn->finish();
+    });
+
+    topologyResponse = &smallTopologyResponse;
+    bench("sonosTopologyUpdate small", [] {
+        sonosTopologyUpdate(GARAGE);
+    });
+    topologyResponse = &largeTopologyResponse;
+    bench("sonosTopologyUpdate large", [] {
+        sonosTopologyUpdate(GARAGE);
+    });
+    bench("discoverSonos large", [] {
+        discoverSonos(GARAGE_UUID);
+    });
+
+    // No event subscriptions on the host, so play/pause has to ask the player for its state first
+    int result;
+    bench("sonosPlay", [&result] {
+        sonosOperation(sonosPlay, GARAGE, 1, &result);
+    });
+    bench("sonosNext x1", [&result] {
+        sonosOperation(sonosNext, GARAGE, 1, &result);
+    });
+    bench("sonosNext x3", [&result] {
+        sonosOperation(sonosNext, GARAGE, 3, &result);
+    });
+    // The coordinator turns the skip down, so it reads the topology again inside the skip's budget to check the groups
+    staleCoordinator = sonosTopologyCoordinator(GARAGE);
+    bench("sonosNext x1, coordinator turns it down", [&result] {
+        sonosOperation(sonosNext, GARAGE, 1, &result);
+    });
+    staleCoordinator = IPAddress();
+    bench("changeVolume +7", [&result] {
+        sonosOperation(changeVolume, GARAGE, VOLUME_STEP, &result);
+    });
+    // A held volume button, one request per step either way but the ramp doesn't wait for each reply
+    bench("changeVolume +2 x10", [&result] {
+        for (int i = 0; i < 10; i++) {
+            sonosOperation(changeVolume, GARAGE, VOLUME_RAMP_STEP, &result);
+        }
+    });
+    bench("sonosRampVolume +2 x10", [&result] {
+        for (int i = 0; i < 10; i++) {
+            sonosRampVolume(GARAGE, VOLUME_RAMP_STEP, &result);
+        }
+        sonosRampEnd(&result);
+    });
+
+    // The same command to every group in the house, with a round trip to each player like a real network has.
+    // One at a time takes the sum of the round trips, the fan-out about the longest one
+    static IPAddress groups[SONOS_FANOUT_MAX];
+    static uint8_t groupCount = sonosTopologyCoordinators(groups, SONOS_FANOUT_MAX);
+    static SonosFanResult results[SONOS_FANOUT_MAX];
+    fakeNetwork.latencyUs = 2000;
+    bench("changeVolume every group, 2ms rtt", [&result] {
+        for (uint8_t i = 0; i < groupCount; i++) {
+            sonosOperation(changeVolume, groups[i], VOLUME_STEP, &result);
+        }
+    });
+    bench("sonosFanOut volume, 2ms rtt", [] {
+        sonosFanOut(SONOS_VOLUME, VOLUME_STEP, groups, groupCount, results);
+    });
+    bench("sonosFanOut pause, 2ms rtt", [] {
+        sonosFanOut(SONOS_PAUSE, 1, groups, groupCount, results);
+    });
+
+    // A newer press cancelling a request on a slow network, it should give up within SONOS_CANCEL_CHECK_MS
+    // of the cancel instead of waiting out the round trip
+    fakeNetwork.latencyUs = 50000;
+    bench("changeVolume cancelled at 5ms, 50ms rtt", [&result] {
+        fakeNetworkBusy++;
+        std::thread canceller([] {
+            delay(5);
+            sonosCancel();
+        });
+        fakeNetworkBusy--;
+        sonosCancelBegin();
+        sonosOperation(changeVolume, GARAGE, VOLUME_STEP, &result);
+        sonosCancelEnd();
+        fakeNetworkBusy++;
+        canceller.join();
+        fakeNetworkBusy--;
+    });
+    fakeNetwork.latencyUs = 0;
+
+    // One answer in ten from the garage comes 100ms late and everything else takes 1ms. Hedging to another
+    // player cuts the late ones off at about the garage's usual worst case instead of waiting them out
+    static unsigned long garageRequests = 0;
+    fakeNetwork.latencyOf = [](IPAddress host) -> unsigned long {
+        return host == GARAGE && ++garageRequests % 10 == 0 ? 100000 : 1000;
+    };
+    bench("post GetVolume, 1 in 10 late by 100ms", [] {
+        SonosConnection *conn = sonosConnection(GARAGE);
+        conn->post(GET_VOLUME);
+        conn->finish();
+    });
+    bench("sonosHedgedPost GetVolume, 1 in 10 late", [] {
+        SonosConnection *conn;
+        sonosHedgedPost(GARAGE, fakeNetwork.ssdpResponder, GET_VOLUME, &conn);
+        conn->finish();
+    });
+    bench("sonosTopologyUpdate, 1 in 10 late", [] {
+        sonosTopologyUpdate(GARAGE);
+    });
+    fakeNetwork.latencyOf = NULL;
+    printf("%d groups\n", groupCount);
+
+    printf("%lu connections, %lu requests\n", fakeNetwork.connects, fakeNetwork.requests);
+
+    Serial.verbose = true;
+    memoryDump();
+    sonosRttDump();
+    return memoryOverBudget() > 0 ? 1 : 0;
+}
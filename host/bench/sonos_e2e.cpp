@@ -0,0 +1,146 @@
+/*
+ * End to end runs of button presses against the simulated household in host/sim, one scenario per kind
+ * of trouble the network gives us. Every press goes through doSonos() in sonos_target.cpp like it does
+ * on the board, discovery and the recovery after it included, and is timed from the press to the
+ * player's answer (or to giving up and finding the player again). Reports p50/p99 press-to-ack times
+ * per scenario and what the radio time costs the battery per press from energy.h, and exits with 1 if
+ * any scenario failed more presses, sent more to the wrong group or had a slower p99 than it's allowed to.
+ *
+ *   sonos_e2e [filter]    only run scenarios whose name contains filter
+ */
+#include <Arduino.h>
+#include <algorithm>
+#include <vector>
+#include "energy.h"
+#include "fake_network.h"
+#include "household.h"
+#include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_events.h"
+#include "sonos_target.h"
+
+// Presses per scenario
+#define E2E_PRESSES 200
+// Players in the household
+#define E2E_PLAYERS 6
+// The kitchen, which starts out grouped with the garage as coordinator
+#define E2E_TARGET 1
+// How long TCP takes to resend a lost segment, lwip's smallest retransmission timeout
+#define E2E_RETRANSMIT_US 1000000
+
+typedef struct {
+    const char *name;
+    SimFaults faults;
+    // Move the target to a new address every this many presses, 0 for never
+    int moveEvery;
+    // Reshuffle the groups every this many presses, 0 for never
+    int regroupEvery;
+    // Most presses that may fail, in percent
+    int maxFailedPercent;
+    // Most play presses that may go to another group's coordinator
+    int maxMisdirected;
+    // Slowest the p99 press-to-ack time may be, with room for a busy machine running the test
+    int maxP99Ms;
+} Scenario;
+
+static const Scenario SCENARIOS[] = {
+    { "healthy, 5ms rtt", { 4000, 2000, 0, 0, 0, 1 }, 0, 0, 0, 0, 100 },
+    { "jitter, 5-45ms rtt", { 5000, 40000, 0, 0, 0, 2 }, 0, 0, 0, 0, 150 },
+    { "2% packet loss", { 4000, 2000, 2, E2E_RETRANSMIT_US, 0, 3 }, 0, 0, 10, 0, 1500 },
+    { "2% connection resets", { 4000, 2000, 0, 0, 2, 4 }, 0, 0, 10, 0, 100 },
+    // Finding the player again shouldn't take anything like a request timeout
+    { "target moves every 25", { 4000, 2000, 0, 0, 0, 5 }, 25, 0, 0, 0, 1000 },
+    { "regroup every 10", { 4000, 2000, 0, 0, 0, 6 }, 0, 10, 0, 0, 100 },
+    { "everything at once", { 5000, 20000, 1, E2E_RETRANSMIT_US, 1, 7 }, 40, 15, 15, 0, 1500 },
+};
+
+// The presses cycle through these
+static const struct {
+    SonosOperation operation;
+    int amount;
+} PRESSES[] = {
+    { changeVolume, VOLUME_STEP },
+    { sonosPlay, 1 },
+    { changeVolume, -VOLUME_STEP },
+    { sonosNext, 1 },
+    { sonosPlay, 1 },
+};
+
+static double percentile(std::vector<unsigned long> &times, int percent) {
+    std::sort(times.begin(), times.end());
+    return times[(times.size() - 1) * percent / 100] / 1000.0;
+}
+
+// Runs the scenario, returns false if too many presses failed or went astray, or they were too slow
+static boolean run(const Scenario &scenario) {
+    simBegin(E2E_PLAYERS, scenario.faults);
+    sonosCloseConnections();
+    sonosTargetBegin(simPlayer(E2E_TARGET).uuid.c_str(), NULL);
+    unsigned long requestsBefore = fakeNetwork.requests;
+    uint64_t radioBefore = energyCharge(ENERGY_HTTP) + energyCharge(ENERGY_DISCOVERY);
+
+    std::vector<unsigned long> times;
+    int failed = 0;
+    // Presses that failed right after one that had, so recovering didn't work
+    int failedAgain = 0;
+    // Play presses that went to a coordinator other than the target's, which then answered for the wrong group
+    int misdirected = 0;
+    boolean lastFailed = false;
+    sonosEventsBegin();
+    for (int i = 0; i < E2E_PRESSES; i++) {
+        if (scenario.moveEvery > 0 && i > 0 && i % scenario.moveEvery == 0) {
+            simMovePlayer(E2E_TARGET);
+        }
+        if (scenario.regroupEvery > 0 && i > 0 && i % scenario.regroupEvery == 0) {
+            simRegroup();
+        }
+
+        int pick = i % (sizeof(PRESSES) / sizeof(PRESSES[0]));
+        const SimPlayer &coordinator = simPlayer(simPlayer(E2E_TARGET).coordinator);
+        boolean wasPlaying = coordinator.playing;
+        int result;
+        unsigned long start = micros();
+        int error = doSonos(PRESSES[pick].operation, PRESSES[pick].amount, false, &result);
+        times.push_back(micros() - start);
+
+        if (error != 0) {
+            failed++;
+            if (lastFailed) {
+                failedAgain++;
+            }
+            Serial.printf("Press %d failed with %d\n", i, error);
+        } else if (PRESSES[pick].operation == sonosPlay && coordinator.playing == wasPlaying) {
+            misdirected++;
+        }
+        lastFailed = error != 0;
+        if (sonosTarget()) {
+            sonosEventsPoll(sonosTarget());
+        }
+    }
+    sonosEventsEnd();
+
+    const SimStats &stats = simStats();
+    // uA x ms per press to uAh
+    double radioUah = (energyCharge(ENERGY_HTTP) + energyCharge(ENERGY_DISCOVERY) - radioBefore) / 3.6e6 / E2E_PRESSES;
+    int failedPercent = failed * 100 / E2E_PRESSES;
+    double p99 = percentile(times, 99);
+    boolean passed = failedPercent <= scenario.maxFailedPercent && misdirected <= scenario.maxMisdirected && p99 <= scenario.maxP99Ms;
+    printf("%-26s %6d %6d %5d %5d %8.1f %8.1f %8.1f %9.3f %8lu %4lu/%-4lu %4lu/%-4lu %s\n", scenario.name, E2E_PRESSES, failed, failedAgain,
+        misdirected, percentile(times, 50), p99, percentile(times, 100), radioUah, fakeNetwork.requests - requestsBefore,
+        stats.lost, stats.resets, stats.subscribes, stats.unsubscribes, passed ? "" : "FAILED");
+    simEnd();
+    return passed;
+}
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : NULL;
+    printf("%-26s %6s %6s %5s %5s %8s %8s %8s %9s %8s %9s %9s\n", "scenario", "presses", "failed", "again", "wrong",
+        "p50 ms", "p99 ms", "max ms", "uAh/press", "requests", "lost/rst", "sub/unsub");
+    boolean passed = true;
+    for (size_t i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++) {
+        if (filter == NULL || strstr(SCENARIOS[i].name, filter) != NULL) {
+            passed = run(SCENARIOS[i]) && passed;
+        }
+    }
+    return passed ? 0 : 1;
+}
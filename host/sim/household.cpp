@@ -0,0 +1,384 @@
+#include <Arduino.h>
+#include "fake_network.h"
+#include "household.h"
+
+static const char *const ROOM_NAMES[SIM_PLAYERS_MAX] = {
+    "Garage", "Kitchen", "Living Room", "Office", "Bedroom", "Bathroom", "Dining Room", "Patio",
+    "Den", "Hallway", "Basement", "Guest Room", "Study", "Porch", "Loft", "Kids Room"
+};
+
+static SimPlayer players[SIM_PLAYERS_MAX];
+static uint8_t playerCount = 0;
+static SimFaults faults;
+static SimStats stats;
+static uint32_t randomState = 1;
+
+// xorshift32, the same sequence for the same seed wherever it runs
+static uint32_t nextRandom() {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static boolean chance(uint8_t percent) {
+    return percent > 0 && nextRandom() % 100 < percent;
+}
+
+static SimPlayer *playerAt(IPAddress address) {
+    for (uint8_t i = 0; i < playerCount; i++) {
+        if (players[i].address == address) {
+            return &players[i];
+        }
+    }
+    return NULL;
+}
+
+static std::string reply(int status, const char *reason, const std::string &headers) {
+    char line[64];
+    snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status, reason);
+    return line + headers + "CONTENT-LENGTH: 0\r\nServer: Linux UPnP/1.0 Sonos/57.3-77280 (ZPS9)\r\n\r\n";
+}
+
+static std::string soapResponse(const std::string &service, const std::string &action, const std::string &values) {
+    return fakeResponse(200,
+        "<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body>"
+        "<u:" + action + "Response xmlns:u=\"urn:schemas-upnp-org:service:" + service + ":1\">" + values +
+        "</u:" + action + "Response></s:Body></s:Envelope>");
+}
+
+// What a player sends back for an action it won't carry out, 800 is what group members say to transport actions
+static std::string upnpError(int code) {
+    return fakeResponse(500,
+        "<?xml version=\"1.0\"?><s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+        "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\"><s:Body><s:Fault>"
+        "<faultcode>s:Client</faultcode><faultstring>UPnPError</faultstring><detail>"
+        "<UPnPError xmlns=\"urn:schemas-upnp-org:control-1-0\"><errorCode>" + std::to_string(code) +
+        "</errorCode></UPnPError></detail></s:Fault></s:Body></s:Envelope>");
+}
+
+static int intArgument(const std::string &body, const char *name) {
+    std::string open = std::string("<") + name + ">";
+    size_t start = body.find(open);
+    return start == std::string::npos ? 0 : atoi(body.c_str() + start + open.length());
+}
+
+// The ZoneGroupState document, escaped inside the response like the players do it
+static std::string zoneGroupState() {
+    std::string state = "&lt;ZoneGroupState&gt;&lt;ZoneGroups&gt;";
+    for (uint8_t c = 0; c < playerCount; c++) {
+        if (players[c].coordinator != c) {
+            continue;
+        }
+        state += "&lt;ZoneGroup Coordinator=&quot;" + players[c].uuid + "&quot; ID=&quot;" + players[c].uuid + ":1&quot;&gt;";
+        for (uint8_t i = 0; i < playerCount; i++) {
+            if (players[i].coordinator == c) {
+                state += "&lt;ZoneGroupMember UUID=&quot;" + players[i].uuid + "&quot; Location=&quot;http://" +
+                    players[i].address.toString().c_str() + ":1400/xml/device_description.xml&quot; ZoneName=&quot;" +
+                    players[i].name + "&quot;/&gt;";
+            }
+        }
+        state += "&lt;/ZoneGroup&gt;";
+    }
+    return state + "&lt;/ZoneGroups&gt;&lt;VanishedDevices&gt;&lt;/VanishedDevices&gt;&lt;/ZoneGroupState&gt;";
+}
+
+static const char *const EVENT_PATHS[SIM_SERVICES] = {
+    "/MediaRenderer/AVTransport/Event",
+    "/MediaRenderer/RenderingControl/Event",
+    "/ZoneGroupTopology/Event"
+};
+
+// Send a NOTIFY with property to a subscription of player's, if it has one
+static void notifyProperty(SimPlayer *player, SimService service, const std::string &property) {
+    SimSubscription *sub = &player->events[service];
+    if (sub->sid.empty()) {
+        return;
+    }
+    stats.notifies++;
+    std::string body = "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\"><e:property>" + property +
+        "</e:property></e:propertyset>";
+    fakeNotify("NOTIFY " + sub->callback + " HTTP/1.1\r\n"
+        "CONTENT-TYPE: text/xml\r\n"
+        "CONTENT-LENGTH: " + std::to_string(body.length()) + "\r\n"
+        "NT: upnp:event\r\n"
+        "NTS: upnp:propchange\r\n"
+        "SID: " + sub->sid + "\r\n"
+        "SEQ: " + std::to_string(sub->seq++) + "\r\n"
+        "\r\n" + body);
+}
+
+// A LastChange holding change
+static void notify(SimPlayer *player, SimService service, const std::string &change) {
+    notifyProperty(player, service, "<LastChange>&lt;Event xmlns=&quot;urn:schemas-upnp-org:metadata-1-0/" +
+        std::string(service == SIM_AVTRANSPORT ? "AVT" : "RCS") + "/&quot;&gt;&lt;InstanceID val=&quot;0&quot;&gt;" + change +
+        "&lt;/InstanceID&gt;&lt;/Event&gt;</LastChange>");
+}
+
+static void notifyTopology(SimPlayer *player) {
+    notifyProperty(player, SIM_TOPOLOGY, "<ZoneGroupState>" + zoneGroupState() + "</ZoneGroupState>");
+}
+
+// Every player tells its topology subscribers when anything in the household changes
+static void notifyHousehold() {
+    for (uint8_t i = 0; i < playerCount; i++) {
+        notifyTopology(&players[i]);
+    }
+}
+
+// Members report their coordinator's transport state
+static void notifyTransport(SimPlayer *player) {
+    notify(player, SIM_AVTRANSPORT, std::string("&lt;TransportState val=&quot;") +
+        (players[player->coordinator].playing ? "PLAYING" : "PAUSED_PLAYBACK") + "&quot;/&gt;");
+}
+
+static void notifyVolume(SimPlayer *player) {
+    notify(player, SIM_RENDERING, "&lt;Volume channel=&quot;Master&quot; val=&quot;" + std::to_string(player->volume) + "&quot;/&gt;");
+}
+
+// The transport state of coordinator's group changed
+static void notifyGroup(uint8_t coordinator) {
+    for (uint8_t i = 0; i < playerCount; i++) {
+        if (players[i].coordinator == coordinator) {
+            notifyTransport(&players[i]);
+        }
+    }
+}
+
+static std::string transport(SimPlayer *player, const std::string &action) {
+    if (&players[player->coordinator] != player) {
+        stats.notCoordinator++;
+        return upnpError(800);
+    }
+    if (action == "Play" || action == "Pause") {
+        player->playing = action == "Play";
+        notifyGroup(player->coordinator);
+    } else if (action == "Next") {
+        player->track++;
+    } else if (action == "Previous") {
+        player->track--;
+    } else if (action == "GetTransportInfo") {
+        return soapResponse("AVTransport", action, std::string("<CurrentTransportState>") +
+            (player->playing ? "PLAYING" : "PAUSED_PLAYBACK") +
+            "</CurrentTransportState><CurrentTransportStatus>OK</CurrentTransportStatus><CurrentSpeed>1</CurrentSpeed>");
+    } else {
+        return upnpError(401);
+    }
+    return soapResponse("AVTransport", action, "");
+}
+
+static std::string rendering(SimPlayer *player, const std::string &action, const std::string &body) {
+    if (action == "GetVolume") {
+        return soapResponse("RenderingControl", action, "<CurrentVolume>" + std::to_string(player->volume) + "</CurrentVolume>");
+    } else if (action == "SetVolume") {
+        player->volume = constrain(intArgument(body, "DesiredVolume"), 0, 100);
+        notifyVolume(player);
+        return soapResponse("RenderingControl", action, "");
+    } else if (action == "SetRelativeVolume") {
+        player->volume = constrain(player->volume + intArgument(body, "Adjustment"), 0, 100);
+        notifyVolume(player);
+        return soapResponse("RenderingControl", action, "<NewVolume>" + std::to_string(player->volume) + "</NewVolume>");
+    }
+    return upnpError(401);
+}
+
+// GENA, a renewal has to carry a SID the player handed out and a new subscription a CALLBACK
+static std::string subscribe(SimPlayer *player, const FakeRequest &request) {
+    int service = 0;
+    while (service < SIM_SERVICES && request.path != EVENT_PATHS[service]) {
+        service++;
+    }
+    if (service == SIM_SERVICES) {
+        return reply(404, "Not Found", "");
+    }
+    SimSubscription *sub = &player->events[service];
+    std::string sid = fakeHeader(request.headers, "SID");
+    if (request.method == "UNSUBSCRIBE") {
+        stats.unsubscribes++;
+        if (sid.empty() || sid != sub->sid) {
+            return reply(412, "Precondition Failed", "");
+        }
+        sub->sid.clear();
+        return reply(200, "OK", "");
+    }
+
+    stats.subscribes++;
+    boolean fresh = sid.empty();
+    if (!fresh) {
+        if (sid != sub->sid) {
+            return reply(412, "Precondition Failed", "");
+        }
+    } else {
+        // CALLBACK: <http://192.168.1.50:3400/avt>
+        std::string callback = fakeHeader(request.headers, "CALLBACK");
+        size_t path = callback.find('/', callback.find("//") + 2);
+        if (callback.empty() || path == std::string::npos) {
+            return reply(412, "Precondition Failed", "");
+        }
+        sub->callback = callback.substr(path, callback.find('>') - path);
+        sub->sid = "uuid:" + player->uuid + "_sub" + std::to_string(nextRandom() % 100000);
+        sub->seq = 0;
+    }
+    std::string timeout = fakeHeader(request.headers, "TIMEOUT");
+    std::string response = reply(200, "OK", "SID: " + sub->sid + "\r\nTIMEOUT: " + (timeout.empty() ? "Second-3600" : timeout) + "\r\n");
+    if (fresh) {
+        // A new subscription starts with an event holding everything
+        if (service == SIM_AVTRANSPORT) {
+            notifyTransport(player);
+        } else if (service == SIM_RENDERING) {
+            notifyVolume(player);
+        } else {
+            notifyTopology(player);
+        }
+    }
+    return response;
+}
+
+static std::string answer(const FakeRequest &request) {
+    SimPlayer *player = playerAt(request.host);
+    if (player == NULL) {
+        return fakeResponse(404, "");
+    }
+    if (request.method == "SUBSCRIBE" || request.method == "UNSUBSCRIBE") {
+        return subscribe(player, request);
+    }
+
+    stats.soapRequests++;
+    size_t hash = request.soapAction.find('#');
+    std::string action = hash == std::string::npos ? "" : request.soapAction.substr(hash + 1);
+    if (!action.empty() && action.back() == '"') {
+        action.erase(action.length() - 1);
+    }
+    if (request.path == "/ZoneGroupTopology/Control" && action == "GetZoneGroupState") {
+        return soapResponse("ZoneGroupTopology", action, "<ZoneGroupState>" + zoneGroupState() + "</ZoneGroupState>");
+    } else if (request.path == "/MediaRenderer/AVTransport/Control") {
+        return transport(player, action);
+    } else if (request.path == "/MediaRenderer/RenderingControl/Control") {
+        return rendering(player, action, request.body);
+    }
+    return fakeResponse(404, "");
+}
+
+static FakeFault fault(IPAddress host, boolean connecting) {
+    if (playerAt(host) == NULL) {
+        stats.dropped++;
+        return FAKE_DROP;
+    }
+    uint32_t roll = nextRandom() % 100;
+    if (roll < faults.lossPercent) {
+        stats.lost++;
+        return FAKE_LOSE;
+    } else if (roll < (uint32_t) faults.lossPercent + faults.resetPercent) {
+        stats.resets++;
+        return FAKE_RESET;
+    }
+    return FAKE_DELIVER;
+}
+
+static unsigned long latency(IPAddress host) {
+    return faults.latencyUs + (faults.jitterUs > 0 ? nextRandom() % faults.jitterUs : 0);
+}
+
+// Players answer in whatever order they get to it
+static std::vector<std::pair<std::string, IPAddress>> ssdpAnswers() {
+    std::vector<std::pair<std::string, IPAddress>> answers;
+    uint8_t first = playerCount > 0 ? nextRandom() % playerCount : 0;
+    for (uint8_t i = 0; i < playerCount; i++) {
+        const SimPlayer &player = players[(first + i) % playerCount];
+        if (chance(faults.lossPercent)) {
+            stats.lost++;
+        } else {
+            answers.push_back(std::make_pair(player.uuid, player.address));
+        }
+    }
+    return answers;
+}
+
+void simBegin(uint8_t count, const SimFaults &simFaults) {
+    faults = simFaults;
+    randomState = faults.seed != 0 ? faults.seed : 1;
+    memset(&stats, 0, sizeof(stats));
+    playerCount = count < SIM_PLAYERS_MAX ? count : SIM_PLAYERS_MAX;
+    for (uint8_t i = 0; i < playerCount; i++) {
+        char uuid[32];
+        snprintf(uuid, sizeof(uuid), "RINCON_000E58A0B1%02X01400", 0xC2 + i);
+        players[i].uuid = uuid;
+        players[i].name = ROOM_NAMES[i];
+        players[i].address = IPAddress(192, 168, 1, 20 + i);
+        players[i].coordinator = i - i % 2;
+        players[i].volume = 20;
+        players[i].playing = false;
+        players[i].track = 0;
+        for (uint8_t j = 0; j < SIM_SERVICES; j++) {
+            players[i].events[j].sid.clear();
+        }
+    }
+
+    fakeNetwork.handler = answer;
+    fakeNetwork.reachable = NULL;
+    fakeNetwork.ssdpAnswers = ssdpAnswers;
+    fakeNetwork.latencyOf = latency;
+    fakeNetwork.fault = fault;
+    fakeNetwork.retransmitUs = faults.retransmitUs;
+}
+
+void simEnd() {
+    fakeNetwork.handler = NULL;
+    fakeNetwork.ssdpAnswers = NULL;
+    fakeNetwork.latencyOf = NULL;
+    fakeNetwork.fault = NULL;
+    fakeNetwork.retransmitUs = 0;
+    playerCount = 0;
+}
+
+uint8_t simPlayerCount() {
+    return playerCount;
+}
+
+const SimPlayer &simPlayer(uint8_t index) {
+    return players[index];
+}
+
+void simMovePlayer(uint8_t index) {
+    stats.moves++;
+    // Addresses from .100 on are new to everyone
+    players[index].address = IPAddress(192, 168, 1, 100 + stats.moves % 150);
+    // The player rebooted onto its new lease, whatever we subscribed to is gone
+    for (uint8_t i = 0; i < SIM_SERVICES; i++) {
+        players[index].events[i].sid.clear();
+    }
+    notifyHousehold();
+}
+
+void simRegroup() {
+    stats.regroups++;
+    uint8_t order[SIM_PLAYERS_MAX];
+    for (uint8_t i = 0; i < playerCount; i++) {
+        order[i] = i;
+    }
+    for (uint8_t i = playerCount; i > 1; i--) {
+        uint8_t j = nextRandom() % i;
+        uint8_t swap = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = swap;
+    }
+    // The first of each run of one to three is the new group's coordinator
+    uint8_t i = 0;
+    while (i < playerCount) {
+        uint8_t size = 1 + nextRandom() % 3;
+        uint8_t coordinator = order[i];
+        for (uint8_t j = 0; j < size && i < playerCount; j++, i++) {
+            players[order[i]].coordinator = coordinator;
+        }
+    }
+    // Everyone's transport state is now their new coordinator's
+    for (uint8_t i = 0; i < playerCount; i++) {
+        notifyTransport(&players[i]);
+    }
+    notifyHousehold();
+}
+
+const SimStats &simStats() {
+    return stats;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <Arduino.h>
+#include <string>
+
+// Most players a simulated household has
+#define SIM_PLAYERS_MAX 16
+
+// The services players send us events for
+typedef enum {
+    SIM_AVTRANSPORT,
+    SIM_RENDERING,
+    SIM_TOPOLOGY,
+    SIM_SERVICES
+} SimService;
+
+typedef struct {
+    // Empty if we aren't subscribed
+    std::string sid;
+    // Path on our event listener the NOTIFYs go to
+    std::string callback;
+    uint32_t seq;
+} SimSubscription;
+
+typedef struct {
+    std::string uuid;
+    std::string name;
+    IPAddress address;
+    // Index of the coordinator of the player's group, which may be the player itself
+    uint8_t coordinator;
+    int volume;
+    // Transport state, only kept on coordinators
+    boolean playing;
+    int track;
+    // GENA subscriptions the player is keeping for us
+    SimSubscription events[SIM_SERVICES];
+} SimPlayer;
+
+typedef struct {
+    // Round trip to every player, plus up to jitterUs more picked at random for each connect and request
+    unsigned long latencyUs;
+    unsigned long jitterUs;
+    // Percent of connects, requests and SSDP answers that lose a packet. Lost TCP segments get resent
+    // retransmitUs later, lost SSDP answers are gone
+    uint8_t lossPercent;
+    unsigned long retransmitUs;
+    // Percent of connects and requests the player resets instead of answering
+    uint8_t resetPercent;
+    // Runs with the same seed make the same choices
+    uint32_t seed;
+} SimFaults;
+
+typedef struct {
+    unsigned long soapRequests;
+    unsigned long subscribes;
+    unsigned long unsubscribes;
+    unsigned long notifies;
+    // Transport actions sent to a player that isn't its group's coordinator
+    unsigned long notCoordinator;
+    unsigned long lost;
+    unsigned long dropped;
+    unsigned long resets;
+    unsigned long moves;
+    unsigned long regroups;
+} SimStats;
+
+/**
+ * A Sonos household for the host build to talk to, sitting behind the fake network in fake_network.h.
+ *
+ * Each player answers SSDP searches and the ZoneGroupTopology, AVTransport and RenderingControl
+ * actions we use, and takes GENA subscriptions, sending NOTIFYs through fakeNotify() as its state
+ * changes and the whole topology whenever a player moves or the groups change. Transport actions
+ * only work on a group's coordinator, the other members turn them down with UPnP error 800 and
+ * report their coordinator's state in their events like real players do. Faults are injected on
+ * every connect and request: latency with jitter, lost packets, resets, players moving to a new
+ * address (the old one goes quiet) and groups being reshuffled. Everything random comes from the
+ * seed, so a run can be repeated.
+ */
+
+// Set up count players (addresses 192.168.1.20 on) grouped in pairs, and take over fakeNetwork
+void simBegin(uint8_t count, const SimFaults &faults);
+
+// Give the fakeNetwork back
+void simEnd();
+
+uint8_t simPlayerCount();
+const SimPlayer &simPlayer(uint8_t index);
+
+// The player's DHCP lease changed, it turns up at an address nobody has used yet
+void simMovePlayer(uint8_t index);
+
+// Shuffle the players into new groups of one to three, with new coordinators
+void simRegroup();
+
+const SimStats &simStats();
@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ * Just enough of the Arduino core and FreeRTOS for the sonos protocol layer to build and run on
+ * Linux. The network side of it is faked in fake_network.h.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <mutex>
+
+typedef bool boolean;
+
+#define RTC_DATA_ATTR
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+class String {
+    public:
+        String(const char *s = "") : s(s) {}
+        String(const std::string &s) : s(s) {}
+        explicit String(int value) : s(std::to_string(value)) {}
+        const char *c_str() const { return s.c_str(); }
+        unsigned int length() const { return s.length(); }
+        long toInt() const { return atol(s.c_str()); }
+        bool operator==(const String &other) const { return s == other.s; }
+        bool operator!=(const String &other) const { return s != other.s; }
+    private:
+        std::string s;
+};
+
+// Same layout and conversions as the ESP32 core's, including testing an address with !address
+class IPAddress {
+    public:
+        IPAddress() { address.dword = 0; }
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+            address.bytes[0] = a;
+            address.bytes[1] = b;
+            address.bytes[2] = c;
+            address.bytes[3] = d;
+        }
+        IPAddress(uint32_t dword) { address.dword = dword; }
+        operator uint32_t() const { return address.dword; }
+        bool operator==(const IPAddress &other) const { return address.dword == other.address.dword; }
+        uint8_t operator[](int index) const { return address.bytes[index]; }
+        uint8_t &operator[](int index) { return address.bytes[index]; }
+        bool fromString(const char *s);
+        String toString() const;
+    private:
+        union {
+            uint8_t bytes[4];
+            uint32_t dword;
+        } address;
+};
+
+class HardwareSerial {
+    public:
+        void begin(unsigned long baud) {}
+        int available() { return 0; }
+        int read() { return -1; }
+        // Formatted like on the device so the cost is comparable, only written out when verbose
+        int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+        void println(const char *s);
+        void print(const char *s);
+        boolean verbose = false;
+};
+extern HardwareSerial Serial;
+
+// FreeRTOS
+typedef void *SemaphoreHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+#define portMAX_DELAY ((TickType_t) 0xffffffff)
+
+typedef void *TaskHandle_t;
+typedef unsigned int UBaseType_t;
+// Everything runs on one task on the host
+TaskHandle_t xTaskGetCurrentTaskHandle();
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);
+char *pcTaskGetTaskName(TaskHandle_t task);
+
+// A spinlock on the device, a mutex does here
+typedef struct {
+    std::mutex lock;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {}
+void portENTER_CRITICAL(portMUX_TYPE *mux);
+void portEXIT_CRITICAL(portMUX_TYPE *mux);
+
+SemaphoreHandle_t xSemaphoreCreateBinary();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore);
+void vSemaphoreDelete(SemaphoreHandle_t semaphore);
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+class AsyncUDPPacket {
+    public:
+        AsyncUDPPacket(const std::string &payload, IPAddress remote) : payload(payload), remote(remote) {}
+        uint8_t *data() { return (uint8_t *) &payload[0]; }
+        size_t length() { return payload.length(); }
+        IPAddress remoteIP() { return remote; }
+    private:
+        std::string payload;
+        IPAddress remote;
+};
+
+typedef std::function<void(AsyncUDPPacket packet)> AuPacketHandlerFunction;
+
+// Searches are answered by fakeNetwork's SSDP responders, if it has any
+class AsyncUDP {
+    public:
+        bool listenMulticast(const IPAddress addr, uint16_t port) { return true; }
+        void onPacket(AuPacketHandlerFunction cb) { handler = cb; }
+        size_t broadcast(const char *data);
+        void close() { handler = NULL; }
+    private:
+        AuPacketHandlerFunction handler;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <Arduino.h>
+
+// NVS kept in memory, survives for as long as the process does
+class Preferences {
+    public:
+        bool begin(const char *name, bool readOnly = false);
+        void end() {}
+        size_t getBytes(const char *key, void *buf, size_t maxLen);
+        size_t putBytes(const char *key, const void *value, size_t len);
+        String getString(const char *key, String defaultValue = String());
+        size_t putString(const char *key, String value);
+        bool remove(const char *key);
+    private:
+        std::string space;
+};
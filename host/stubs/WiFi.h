@@ -0,0 +1,18 @@
+#pragma once
+
+#include <WiFiClient.h>
+
+// Hands out the connections fakeNotify() queued up, see fake_network.cpp
+class WiFiServer {
+    public:
+        WiFiServer(uint16_t port) {}
+        void begin() {}
+        void end() {}
+        WiFiClient available();
+};
+
+class WiFiClass {
+    public:
+        IPAddress localIP() { return IPAddress(192, 168, 1, 50); }
+};
+extern WiFiClass WiFi;
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+#include <memory>
+
+// Only the event listener uses WiFiClient, for the players connecting to us with the NOTIFYs queued by
+// fakeNotify(), and whatever we answer is thrown away. SonosConnection's sockets are answered by the fake
+// network behind lwip/sockets.h
+class WiFiClient {
+    public:
+        WiFiClient() : pos(0) {}
+        WiFiClient(std::shared_ptr<std::string> request) : request(request), pos(0) {}
+        uint8_t connected() { return request && pos < request->length(); }
+        int available() { return request ? request->length() - pos : 0; }
+        // There's no socket behind it, everything the player sent is already there
+        int fd() const { return -1; }
+        int read() { return available() > 0 ? (uint8_t) (*request)[pos++] : -1; }
+        int read(uint8_t *buf, size_t len) {
+            size_t count = available();
+            if (count == 0) {
+                return -1;
+            }
+            count = count < len ? count : len;
+            memcpy(buf, request->data() + pos, count);
+            pos += count;
+            return count;
+        }
+        size_t print(const char *s) { return strlen(s); }
+        void stop() { request.reset(); }
+        operator bool() { return request != nullptr; }
+    private:
+        std::shared_ptr<std::string> request;
+        size_t pos;
+};
@@ -0,0 +1,189 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include <WiFi.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include "fake_network.h"
+#include <stdarg.h>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+HardwareSerial Serial;
+WiFiClass WiFi;
+
+static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+
+unsigned long millis() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+unsigned long micros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - boot).count();
+}
+
+int64_t esp_timer_get_time() {
+    return micros();
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+bool IPAddress::fromString(const char *s) {
+    unsigned int a, b, c, d;
+    char extra;
+    if (sscanf(s, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 || a > 255 || b > 255 || c > 255 || d > 255) {
+        return false;
+    }
+    *this = IPAddress(a, b, c, d);
+    return true;
+}
+
+String IPAddress::toString() const {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+    return String(buf);
+}
+
+int HardwareSerial::printf(const char *format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (verbose) {
+        fputs(buf, stderr);
+    }
+    return len;
+}
+
+void HardwareSerial::println(const char *s) {
+    if (verbose) {
+        fprintf(stderr, "%s\n", s);
+    }
+}
+
+void HardwareSerial::print(const char *s) {
+    if (verbose) {
+        fputs(s, stderr);
+    }
+}
+
+static char hostTaskName[] = "host";
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return hostTaskName;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    return 0;
+}
+
+char *pcTaskGetTaskName(TaskHandle_t task) {
+    return (char *) task;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+    return 0;
+}
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+    return 0;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+    return 0;
+}
+
+void portENTER_CRITICAL(portMUX_TYPE *mux) {
+    mux->lock.lock();
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE *mux) {
+    mux->lock.unlock();
+}
+
+typedef struct {
+    std::mutex lock;
+    std::condition_variable signal;
+    bool given;
+} Semaphore;
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+    Semaphore *semaphore = new Semaphore();
+    semaphore->given = false;
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t handle, TickType_t ticks) {
+    Semaphore *semaphore = (Semaphore *) handle;
+    std::unique_lock<std::mutex> guard(semaphore->lock);
+    if (!semaphore->signal.wait_for(guard, std::chrono::milliseconds(ticks), [semaphore] { return semaphore->given; })) {
+        return pdFALSE;
+    }
+    semaphore->given = false;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t handle) {
+    Semaphore *semaphore = (Semaphore *) handle;
+    {
+        std::lock_guard<std::mutex> guard(semaphore->lock);
+        semaphore->given = true;
+    }
+    semaphore->signal.notify_one();
+    return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t handle) {
+    delete (Semaphore *) handle;
+}
+
+// NVS is faked along with the network, so its allocations are left out of the counts the same way
+static std::map<std::string, std::string> nvs;
+
+bool Preferences::begin(const char *name, bool readOnly) {
+    fakeNetworkBusy++;
+    space = std::string(name) + ".";
+    fakeNetworkBusy--;
+    return true;
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen) {
+    auto found = nvs.find(space + key);
+    if (found == nvs.end() || found->second.length() > maxLen) {
+        return 0;
+    }
+    memcpy(buf, found->second.data(), found->second.length());
+    return found->second.length();
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+    fakeNetworkBusy++;
+    nvs[space + key] = std::string((const char *) value, len);
+    fakeNetworkBusy--;
+    return len;
+}
+
+String Preferences::getString(const char *key, String defaultValue) {
+    auto found = nvs.find(space + key);
+    return found == nvs.end() ? defaultValue : String(found->second);
+}
+
+size_t Preferences::putString(const char *key, String value) {
+    fakeNetworkBusy++;
+    nvs[space + key] = value.c_str();
+    fakeNetworkBusy--;
+    return value.length();
+}
+
+bool Preferences::remove(const char *key) {
+    return nvs.erase(space + key) > 0;
+}
@@ -0,0 +1,382 @@
+#include <Arduino.h>
+#include <AsyncUDP.h>
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include <climits>
+#include <deque>
+#include <map>
+#include <utility>
+#include "fake_network.h"
+
+FakeNetwork fakeNetwork;
+int fakeNetworkBusy = 0;
+
+std::string fakeResponse(int status, const std::string &body) {
+    char headers[160];
+    snprintf(headers, sizeof(headers),
+        "HTTP/1.1 %d %s\r\n"
+        "CONTENT-LENGTH: %u\r\n"
+        "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+        "Server: Linux UPnP/1.0 Sonos/57.3-77280 (ZPS9)\r\n"
+        "\r\n",
+        status, status == 200 ? "OK" : "Internal Server Error", (unsigned int) body.length());
+    return headers + body;
+}
+
+// One end of a TCP connection to a fake player
+typedef struct {
+    IPAddress remote;
+    // When the connect finishes, it takes a round trip like the real thing
+    unsigned long connectedAt;
+    boolean open;
+    std::string tx;
+    std::string rx;
+    size_t rxPos;
+    // rx up to here has arrived, the rest is still on its way
+    size_t rxReady;
+    // Where each response still on its way ends in rx, and the micros() it arrives at
+    std::deque<std::pair<size_t, unsigned long>> arriving;
+    // When the player's reset gets to us, 0 if it hasn't reset the connection
+    unsigned long resetAt;
+} FakeSocket;
+
+// Where socket numbers start, lwip's come after the VFS's own files too
+#define LWIP_SOCKET_OFFSET 3
+
+static std::map<int, FakeSocket> sockets;
+
+// Keeps the fake's own allocations out of the counts for as long as it's in scope
+class FakeBusy {
+    public:
+        FakeBusy() { fakeNetworkBusy++; }
+        ~FakeBusy() { fakeNetworkBusy--; }
+};
+
+static FakeSocket *findSocket(int s) {
+    std::map<int, FakeSocket>::iterator found = sockets.find(s);
+    return found == sockets.end() ? NULL : &found->second;
+}
+
+// Never, for things that are never going to arrive
+#define FAKE_NEVER ULONG_MAX
+
+static unsigned long latency(IPAddress host) {
+    return fakeNetwork.latencyOf ? fakeNetwork.latencyOf(host) : fakeNetwork.latencyUs;
+}
+
+static FakeFault fault(IPAddress host, boolean connecting) {
+    return fakeNetwork.fault ? fakeNetwork.fault(host, connecting) : FAKE_DELIVER;
+}
+
+// The micros() something sent to host now gets answered at, after whatever fault picked happens to it
+static unsigned long arrival(IPAddress host, FakeFault what) {
+    if (what == FAKE_DROP) {
+        return FAKE_NEVER;
+    }
+    return micros() + latency(host) + (what == FAKE_LOSE ? fakeNetwork.retransmitUs : 0);
+}
+
+// Let through the responses whose latency is up
+static void deliver(FakeSocket *socket) {
+    while (!socket->arriving.empty() && micros() >= socket->arriving.front().second) {
+        socket->rxReady = socket->arriving.front().first;
+        socket->arriving.pop_front();
+    }
+}
+
+std::string fakeHeader(const std::string &headers, const char *name) {
+    size_t nameLen = strlen(name);
+    size_t pos = 0;
+    while ((pos = headers.find("\r\n", pos)) != std::string::npos) {
+        pos += 2;
+        if (strncasecmp(headers.c_str() + pos, name, nameLen) == 0 && headers[pos + nameLen] == ':') {
+            size_t start = headers.find_first_not_of(' ', pos + nameLen + 1);
+            return headers.substr(start, headers.find("\r\n", start) - start);
+        }
+    }
+    return "";
+}
+
+// Answer the request in tx once all of it has arrived
+static void serve(FakeSocket *socket) {
+    size_t headerEnd = socket->tx.find("\r\n\r\n");
+    if (headerEnd == std::string::npos) {
+        return;
+    }
+    std::string headers = socket->tx.substr(0, headerEnd + 2);
+    size_t length = atoi(fakeHeader(headers, "Content-Length").c_str());
+    if (socket->tx.length() < headerEnd + 4 + length) {
+        return;
+    }
+
+    FakeRequest request;
+    request.host = socket->remote;
+    size_t methodEnd = headers.find(' ');
+    request.method = headers.substr(0, methodEnd);
+    request.path = headers.substr(methodEnd + 1, headers.find(' ', methodEnd + 1) - methodEnd - 1);
+    request.soapAction = fakeHeader(headers, "SOAPACTION");
+    request.headers = headers;
+    request.body = socket->tx.substr(headerEnd + 4, length);
+    socket->tx.erase(0, headerEnd + 4 + length);
+
+    fakeNetwork.requests++;
+    FakeFault what = fault(socket->remote, false);
+    if (what == FAKE_RESET) {
+        // Whatever was still on its way back is lost with the connection
+        socket->resetAt = micros() + latency(socket->remote);
+        return;
+    } else if (what == FAKE_DROP) {
+        return;
+    }
+    if (socket->rxPos == socket->rx.length()) {
+        socket->rx.clear();
+        socket->rxPos = 0;
+        socket->rxReady = 0;
+    }
+    socket->rx += fakeNetwork.handler ? fakeNetwork.handler(request) : fakeResponse(404, "");
+    socket->arriving.push_back(std::make_pair(socket->rx.length(), arrival(socket->remote, what)));
+    deliver(socket);
+}
+
+
+int lwip_socket(int domain, int type, int protocol) {
+    FakeBusy busy;
+    // Numbers get reused like lwip's do, so they stay small enough for an fd_set
+    int s = LWIP_SOCKET_OFFSET;
+    while (sockets.count(s) > 0) {
+        s++;
+    }
+    FakeSocket &socket = sockets[s];
+    socket.open = false;
+    socket.rxPos = 0;
+    socket.rxReady = 0;
+    socket.connectedAt = 0;
+    socket.resetAt = 0;
+    return s;
+}
+
+int lwip_connect(int s, const struct sockaddr *name, socklen_t namelen) {
+    FakeSocket *socket = findSocket(s);
+    IPAddress ip((uint32_t) ((const struct sockaddr_in *) name)->sin_addr.s_addr);
+    if (socket == NULL || (fakeNetwork.reachable && !fakeNetwork.reachable(ip))) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    FakeFault what = fault(ip, true);
+    if (what == FAKE_RESET) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+    fakeNetwork.connects++;
+    socket->remote = ip;
+    socket->open = true;
+    socket->connectedAt = arrival(ip, what);
+    errno = EINPROGRESS;
+    return -1;
+}
+
+static boolean isReset(FakeSocket *socket) {
+    return socket->resetAt != 0 && micros() >= socket->resetAt;
+}
+
+static boolean readable(FakeSocket *socket) {
+    deliver(socket);
+    return socket->rxPos < socket->rxReady || !socket->open || isReset(socket);
+}
+
+static boolean writable(FakeSocket *socket) {
+    return !socket->open || micros() >= socket->connectedAt;
+}
+
+// When the next thing we're waiting on could happen, a response arriving or a connect finishing
+static unsigned long nextEvent(FakeSocket *socket, boolean writing, unsigned long until) {
+    if (writing && socket->open && socket->connectedAt < until) {
+        until = socket->connectedAt;
+    }
+    if (!writing && !socket->arriving.empty() && socket->arriving.front().second < until) {
+        until = socket->arriving.front().second;
+    }
+    if (!writing && socket->resetAt != 0 && socket->resetAt < until) {
+        until = socket->resetAt;
+    }
+    return until;
+}
+
+int lwip_select(int maxfdp1, fd_set *readset, fd_set *writeset, fd_set *exceptset, struct timeval *timeout) {
+    unsigned long until = micros() + (timeout ? timeout->tv_sec * 1000000UL + timeout->tv_usec : 1000000UL);
+    fd_set wantRead, wantWrite;
+    FD_ZERO(&wantRead);
+    FD_ZERO(&wantWrite);
+    if (readset) {
+        wantRead = *readset;
+    }
+    if (writeset) {
+        wantWrite = *writeset;
+    }
+    for (;;) {
+        int ready = 0;
+        unsigned long next = until;
+        for (int s = 0; s < maxfdp1; s++) {
+            FakeSocket *socket = findSocket(s);
+            if (socket == NULL) {
+                continue;
+            }
+            if (readset && FD_ISSET(s, &wantRead)) {
+                if (readable(socket)) {
+                    ready++;
+                } else {
+                    FD_CLR(s, readset);
+                    next = nextEvent(socket, false, next);
+                }
+            }
+            if (writeset && FD_ISSET(s, &wantWrite)) {
+                if (writable(socket)) {
+                    ready++;
+                } else {
+                    FD_CLR(s, writeset);
+                    next = nextEvent(socket, true, next);
+                }
+            }
+        }
+        if (ready > 0 || (long) (micros() - until) >= 0) {
+            return ready;
+        }
+        if (readset) {
+            *readset = wantRead;
+        }
+        if (writeset) {
+            *writeset = wantWrite;
+        }
+        long wait = (long) (next - micros());
+        if (wait > 0) {
+            delayMicroseconds(wait);
+        }
+    }
+}
+
+ssize_t lwip_send(int s, const void *dataptr, size_t size, int flags) {
+    FakeSocket *socket = findSocket(s);
+    if (socket == NULL || !socket->open) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if (isReset(socket)) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (!writable(socket)) {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    FakeBusy busy;
+    socket->tx.append((const char *) dataptr, size);
+    serve(socket);
+    return size;
+}
+
+ssize_t lwip_recv(int s, void *mem, size_t len, int flags) {
+    FakeSocket *socket = findSocket(s);
+    if (socket == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    deliver(socket);
+    size_t count = socket->rxReady - socket->rxPos;
+    if (count == 0) {
+        if (!socket->open) {
+            return 0;
+        }
+        if (isReset(socket)) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    if (count > len) {
+        count = len;
+    }
+    memcpy(mem, socket->rx.data() + socket->rxPos, count);
+    if (!(flags & MSG_PEEK)) {
+        socket->rxPos += count;
+    }
+    return count;
+}
+
+int lwip_fcntl(int s, int cmd, int val) {
+    return 0;
+}
+
+int lwip_setsockopt(int s, int level, int optname, const void *optval, socklen_t optlen) {
+    return 0;
+}
+
+int lwip_getsockopt(int s, int level, int optname, void *optval, socklen_t *optlen) {
+    if (level == SOL_SOCKET && optname == SO_ERROR) {
+        *(int *) optval = 0;
+    }
+    return 0;
+}
+
+int lwip_close(int s) {
+    FakeBusy busy;
+    sockets.erase(s);
+    return 0;
+}
+
+// Players answer a search after a round trip, the first answer is the one that counts so we wait that long
+// and hand them all over at once
+size_t AsyncUDP::broadcast(const char *data) {
+    if (!handler) {
+        return strlen(data);
+    }
+    fakeNetworkBusy++;
+    std::vector<std::pair<std::string, IPAddress>> answers;
+    if (fakeNetwork.ssdpAnswers) {
+        answers = fakeNetwork.ssdpAnswers();
+    } else if (fakeNetwork.ssdpResponder) {
+        answers.push_back(std::make_pair(std::string("RINCON_000E58A0B1C201400"), fakeNetwork.ssdpResponder));
+    }
+    std::vector<AsyncUDPPacket> packets;
+    for (size_t i = 0; i < answers.size(); i++) {
+        packets.push_back(AsyncUDPPacket(
+            "HTTP/1.1 200 OK\r\n"
+            "CACHE-CONTROL: max-age = 1800\r\n"
+            "EXT:\r\n"
+            "LOCATION: http://" + std::string(answers[i].second.toString().c_str()) + ":1400/xml/device_description.xml\r\n"
+            "SERVER: Linux UPnP/1.0 Sonos/57.3-77280 (ZPS9)\r\n"
+            "ST: urn:schemas-upnp-org:device:ZonePlayer:1\r\n"
+            "USN: uuid:" + answers[i].first + "::urn:schemas-upnp-org:device:ZonePlayer:1\r\n"
+            "\r\n",
+            answers[i].second));
+    }
+    fakeNetworkBusy--;
+    if (!answers.empty()) {
+        unsigned long wait = latency(answers[0].second);
+        if (wait > 0) {
+            delayMicroseconds(wait);
+        }
+    }
+    for (size_t i = 0; i < packets.size(); i++) {
+        handler(std::move(packets[i]));
+    }
+    return strlen(data);
+}
+
+// NOTIFYs waiting for the event listener to take them
+static std::deque<std::shared_ptr<std::string>> notifies;
+
+void fakeNotify(const std::string &request) {
+    FakeBusy busy;
+    notifies.push_back(std::make_shared<std::string>(request));
+}
+
+WiFiClient WiFiServer::available() {
+    if (notifies.empty()) {
+        return WiFiClient();
+    }
+    FakeBusy busy;
+    WiFiClient client(notifies.front());
+    notifies.pop_front();
+    return client;
+}
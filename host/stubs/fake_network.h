@@ -0,0 +1,64 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+
+typedef struct {
+    IPAddress host;
+    std::string method;
+    std::string path;
+    std::string soapAction;
+    // The request line and headers, for what isn't in the fields above
+    std::string headers;
+    std::string body;
+} FakeRequest;
+
+// What happens to a connect or a request on its way to a player
+typedef enum {
+    FAKE_DELIVER,
+    // A packet goes missing and TCP resends it, so it gets there retransmitUs late
+    FAKE_LOSE,
+    // Nothing is at the other end to answer, the SYN or request is never heard of again
+    FAKE_DROP,
+    // The player resets the connection, refusing a connect or dropping a request it was sent
+    FAKE_RESET
+} FakeFault;
+
+/**
+ * Stands in for the household on the other end of the lwip sockets and AsyncUDP. Set the handler to
+ * answer requests with a complete HTTP response, fakeResponse() builds one.
+ */
+typedef struct {
+    std::function<std::string(const FakeRequest &request)> handler;
+    // Players that accept connections, everything if empty
+    std::function<bool(IPAddress host)> reachable;
+    // Answers SSDP searches if set
+    IPAddress ssdpResponder;
+    // Overrides ssdpResponder if set, every player it returns answers a search, as uuid and address pairs
+    std::function<std::vector<std::pair<std::string, IPAddress>>()> ssdpAnswers;
+    // How long after a request arrives its response can be read, and how long a connect takes, 0 for straight away
+    unsigned long latencyUs;
+    // Overrides latencyUs per player and per request if set, for players that are sometimes slow
+    std::function<unsigned long(IPAddress host)> latencyOf;
+    // Picks what happens to each connect and request to host if set, everything is delivered otherwise
+    std::function<FakeFault(IPAddress host, boolean connecting)> fault;
+    // How late FAKE_LOSE makes things
+    unsigned long retransmitUs;
+    unsigned long connects;
+    unsigned long requests;
+} FakeNetwork;
+
+extern FakeNetwork fakeNetwork;
+
+// Non zero while the fake itself is running, so allocation counting can leave its allocations out
+extern int fakeNetworkBusy;
+
+// Value of the named header in the request line and headers, empty if it isn't there
+std::string fakeHeader(const std::string &headers, const char *name);
+
+// A player connecting to our event listener to send it request, a complete NOTIFY
+void fakeNotify(const std::string &request);
+
+// A keep-alive HTTP/1.1 response with a Content-Length
+std::string fakeResponse(int status, const std::string &body);
@@ -3,6 +3,9 @@
 #
 # (Uses default behaviour of compiling all source files in directory, adding 'include' to include path.)
 
+# Count allocations for sonos_memory.cpp
+COMPONENT_ADD_LDFLAGS += -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc
+
 ULP_APP_NAME ?= ulp_$(COMPONENT_NAME)
 ULP_S_SOURCES = $(COMPONENT_PATH)/ulp/button_wakeup.S
 ULP_EXP_DEP_OBJECTS := sonos_buttons.o
@@ -0,0 +1,312 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <string.h>
+#include <sys/time.h>
+#include "energy.h"
+
+#define ENERGY_MAGIC 0x454e5247
+// What a full scale ADC reading is at the default 11dB attenuation, check it against a meter too
+#define ENERGY_ADC_FULL_SCALE_MV 3900
+
+static const char *PHASE_NAMES[ENERGY_PHASES] = {
+    "deep sleep",
+    "boot",
+    "wifi join",
+    "discovery",
+    "http",
+    "awake",
+    "doze",
+    "leds"
+};
+
+static const uint32_t PHASE_UA[ENERGY_PHASES] = {
+    ENERGY_DEEP_SLEEP_UA,
+    ENERGY_BOOT_UA,
+    ENERGY_WIFI_JOIN_UA,
+    ENERGY_DISCOVERY_UA,
+    ENERGY_HTTP_UA,
+    ENERGY_AWAKE_UA,
+    ENERGY_DOZE_UA,
+    ENERGY_LED_UA
+};
+
+// A lithium cell's resting voltage against how full it is, roughly
+static const struct {
+    uint16_t mv;
+    uint8_t percent;
+} DISCHARGE_CURVE[] = {
+    { 4200, 100 }, { 4100, 90 }, { 4000, 80 }, { 3900, 65 }, { 3800, 50 },
+    { 3700, 30 }, { 3600, 15 }, { 3500, 7 }, { 3400, 3 }, { 3300, 0 }
+};
+
+typedef struct {
+    // The deep sleep before the cycle and the time awake in it, in ms
+    uint32_t sleptMs;
+    uint32_t awakeMs;
+    // What each cost, in uA x s (uC)
+    uint32_t sleepUc;
+    uint32_t awakeUc;
+    uint16_t presses;
+} EnergyCycle;
+
+static RTC_DATA_ATTR struct {
+    uint32_t magic;
+    // Time in each phase and what it cost since power on, in us and uA x ms (nC). LED time is per LED
+    uint64_t us[ENERGY_PHASES];
+    uint64_t charge[ENERGY_PHASES];
+    // RTC clock ms we went into deep sleep at, 0 if we haven't since power on
+    uint64_t sleptAt;
+    uint32_t ulpPeriodUs;
+    // Battery voltage at the start of the last cycle, 0 if we can't measure it
+    uint16_t batteryMv;
+    uint8_t next;
+    uint8_t count;
+    EnergyCycle cycles[ENERGY_CYCLES];
+} energy;
+
+static EnergyPhase phase = ENERGY_AWAKE;
+// esp_timer time the phase started at
+static int64_t phaseStart = 0;
+static uint8_t litLeds = 0;
+static int64_t ledsStart = 0;
+// This cycle's row, and the awake charge before it started
+static EnergyCycle *current = NULL;
+static uint64_t cycleStart = 0;
+// The command task switches phases, the scanner counts presses and the LEDs get switched from the scanner and
+// the LEDs' timer, so everything in here is only touched with this held. Nothing slow happens while it is, and
+// the time is read once it's taken so nobody can have switched after it
+static portMUX_TYPE energyLock = portMUX_INITIALIZER_UNLOCKED;
+
+static void checkEnergy() {
+    if (energy.magic != ENERGY_MAGIC || energy.next >= ENERGY_CYCLES || energy.count > ENERGY_CYCLES) {
+        memset(&energy, 0, sizeof(energy));
+        energy.magic = ENERGY_MAGIC;
+    }
+}
+
+// The RTC clock keeps counting through deep sleep
+static uint64_t rtcMs() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// The rest of these are called with energyLock held
+static void charge(EnergyPhase p, uint64_t us, uint32_t ua) {
+    energy.us[p] += us;
+    energy.charge[p] += us * ua / 1000;
+}
+
+// Everything but deep sleep, with the phase we're in charged up to now
+static uint64_t awakeCharge(int64_t now) {
+    uint64_t total = (uint64_t) (now - phaseStart) * PHASE_UA[phase] / 1000 + (uint64_t) (now - ledsStart) * litLeds * ENERGY_LED_UA / 1000;
+    for (uint8_t i = 0; i < ENERGY_PHASES; i++) {
+        if (i != ENERGY_DEEP_SLEEP) {
+            total += energy.charge[i];
+        }
+    }
+    return total;
+}
+
+static void switchPhase(EnergyPhase next, int64_t now) {
+    charge(phase, now - phaseStart, PHASE_UA[phase]);
+    phase = next;
+    phaseStart = now;
+}
+
+static void switchLeds(uint8_t lit, int64_t now) {
+    charge(ENERGY_LEDS, (now - ledsStart) * litLeds, ENERGY_LED_UA);
+    litLeds = lit;
+    ledsStart = now;
+}
+
+// Charge in p up to now, counting the phase we're in and the LEDs lit
+static uint64_t chargeUpTo(EnergyPhase p, int64_t now) {
+    uint64_t total = energy.charge[p];
+    if (p == phase) {
+        total += (uint64_t) (now - phaseStart) * PHASE_UA[phase] / 1000;
+    } else if (p == ENERGY_LEDS) {
+        total += (uint64_t) (now - ledsStart) * litLeds * ENERGY_LED_UA / 1000;
+    }
+    return total;
+}
+
+void energyBegin() {
+    // Reading the clock takes a lock of its own, so it can't happen inside ours
+    uint64_t nowMs = rtcMs();
+    portENTER_CRITICAL(&energyLock);
+    checkEnergy();
+    uint64_t slept = 0;
+    uint64_t sleepNc = 0;
+    if (energy.sleptAt != 0 && nowMs > energy.sleptAt) {
+        slept = nowMs - energy.sleptAt;
+        uint64_t scans = energy.ulpPeriodUs > 0 ? slept * 1000 / energy.ulpPeriodUs : 0;
+        sleepNc = slept * ENERGY_DEEP_SLEEP_UA + scans * ENERGY_ULP_SCAN_NC;
+        energy.us[ENERGY_DEEP_SLEEP] += slept * 1000;
+        energy.charge[ENERGY_DEEP_SLEEP] += sleepNc;
+    }
+    energy.sleptAt = 0;
+
+    // Everything since the app started is boot, up to the first switch
+    phase = ENERGY_BOOT;
+    phaseStart = 0;
+    ledsStart = 0;
+    cycleStart = awakeCharge(0);
+    charge(ENERGY_BOOT, ENERGY_BOOTLOADER_MS * 1000UL, ENERGY_BOOT_UA);
+
+    current = &energy.cycles[energy.next];
+    memset(current, 0, sizeof(*current));
+    current->sleptMs = slept;
+    current->sleepUc = sleepNc / 1000;
+    energy.next = (energy.next + 1) % ENERGY_CYCLES;
+    if (energy.count < ENERGY_CYCLES) {
+        energy.count++;
+    }
+    portEXIT_CRITICAL(&energyLock);
+
+#if ENERGY_BATTERY_PIN >= 0
+    // Before wifi is up, the radio pulls the battery down while it's on
+    uint16_t batteryMv = (uint32_t) analogRead(ENERGY_BATTERY_PIN) * ENERGY_ADC_FULL_SCALE_MV * ENERGY_BATTERY_DIVIDER / 4095;
+    portENTER_CRITICAL(&energyLock);
+    energy.batteryMv = batteryMv;
+    portEXIT_CRITICAL(&energyLock);
+#endif
+}
+
+void energyPhase(EnergyPhase next) {
+    portENTER_CRITICAL(&energyLock);
+    int64_t now = esp_timer_get_time();
+    switchPhase(next, now);
+    portEXIT_CRITICAL(&energyLock);
+}
+
+EnergyPhase energyCurrentPhase() {
+    return phase;
+}
+
+void energyLeds(uint8_t lit) {
+    portENTER_CRITICAL(&energyLock);
+    int64_t now = esp_timer_get_time();
+    switchLeds(lit, now);
+    portEXIT_CRITICAL(&energyLock);
+}
+
+void energyPress() {
+    portENTER_CRITICAL(&energyLock);
+    if (current != NULL && current->presses < UINT16_MAX) {
+        current->presses++;
+    }
+    portEXIT_CRITICAL(&energyLock);
+}
+
+void energySleep(uint32_t ulpPeriodUs) {
+    uint64_t nowMs = rtcMs();
+    portENTER_CRITICAL(&energyLock);
+    int64_t now = esp_timer_get_time();
+    checkEnergy();
+    switchPhase(phase, now);
+    switchLeds(litLeds, now);
+    if (current != NULL) {
+        current->awakeMs = now / 1000 + ENERGY_BOOTLOADER_MS;
+        current->awakeUc = (awakeCharge(now) - cycleStart) / 1000;
+        current = NULL;
+    }
+    energy.ulpPeriodUs = ulpPeriodUs;
+    energy.sleptAt = nowMs;
+    portEXIT_CRITICAL(&energyLock);
+}
+
+uint64_t energyCharge(EnergyPhase p) {
+    portENTER_CRITICAL(&energyLock);
+    int64_t now = esp_timer_get_time();
+    uint64_t total = chargeUpTo(p, now);
+    portEXIT_CRITICAL(&energyLock);
+    return total;
+}
+
+static uint8_t batteryPercent(uint16_t mv) {
+    const uint8_t points = sizeof(DISCHARGE_CURVE) / sizeof(DISCHARGE_CURVE[0]);
+    if (mv >= DISCHARGE_CURVE[0].mv) {
+        return 100;
+    }
+    for (uint8_t i = 1; i < points; i++) {
+        if (mv >= DISCHARGE_CURVE[i].mv) {
+            // Straight line between the points either side
+            uint16_t span = DISCHARGE_CURVE[i - 1].mv - DISCHARGE_CURVE[i].mv;
+            return DISCHARGE_CURVE[i].percent + (DISCHARGE_CURVE[i - 1].percent - DISCHARGE_CURVE[i].percent) * (mv - DISCHARGE_CURVE[i].mv) / span;
+        }
+    }
+    return 0;
+}
+
+void energyDump() {
+    // Copy it all out under the lock and print it from the copy, the other tasks keep charging while we print
+    uint64_t nc[ENERGY_PHASES];
+    uint64_t us[ENERGY_PHASES];
+    EnergyCycle cycles[ENERGY_CYCLES];
+    portENTER_CRITICAL(&energyLock);
+    int64_t now = esp_timer_get_time();
+    checkEnergy();
+    for (uint8_t i = 0; i < ENERGY_PHASES; i++) {
+        nc[i] = chargeUpTo((EnergyPhase) i, now);
+        us[i] = energy.us[i] + (i == phase ? now - phaseStart : 0);
+    }
+    uint8_t count = energy.count;
+    for (uint8_t i = 0; i < count; i++) {
+        const EnergyCycle *row = &energy.cycles[(energy.next + ENERGY_CYCLES - count + i) % ENERGY_CYCLES];
+        cycles[i] = *row;
+        if (row == current) {
+            // Still going
+            cycles[i].awakeMs = now / 1000 + ENERGY_BOOTLOADER_MS;
+            cycles[i].awakeUc = (awakeCharge(now) - cycleStart) / 1000;
+        }
+    }
+    uint16_t batteryMv = energy.batteryMv;
+    portEXIT_CRITICAL(&energyLock);
+
+    double totalNc = 0;
+    double totalUs = 0;
+    for (uint8_t i = 0; i < ENERGY_PHASES; i++) {
+        totalNc += nc[i];
+        // LED time overlaps everything else
+        if (i != ENERGY_LEDS) {
+            totalUs += us[i];
+        }
+    }
+    // nC per ms is uA
+    double averageUa = totalUs > 0 ? totalNc / (totalUs / 1000) : 0;
+    Serial.printf("Energy since power on, %.1f hours: %.3f mAh, %.0f uA on average\n", totalUs / 3.6e9, totalNc / 3.6e9, averageUa);
+    Serial.printf("  %-11s %10s %9s %6s\n", "phase", "time", "mAh", "share");
+    for (uint8_t i = 0; i < ENERGY_PHASES; i++) {
+        Serial.printf("  %-11s %9.1fs %9.4f %5.1f%%\n", PHASE_NAMES[i], us[i] / 1e6, nc[i] / 3.6e9, totalNc > 0 ? nc[i] * 100 / totalNc : 0);
+    }
+
+    Serial.printf("Last %u wake cycles, oldest first:\n", count);
+    Serial.printf("  %10s %9s %8s %10s %10s\n", "slept", "awake", "presses", "sleep uAh", "awake uAh");
+    uint32_t pressUc = 0;
+    uint32_t presses = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        const EnergyCycle &cycle = cycles[i];
+        Serial.printf("  %9lus %8lus %8u %10.1f %10.1f\n", (unsigned long) cycle.sleptMs / 1000, (unsigned long) cycle.awakeMs / 1000,
+            cycle.presses, cycle.sleepUc / 3600.0, cycle.awakeUc / 3600.0);
+        if (cycle.presses > 0) {
+            pressUc += cycle.awakeUc;
+            presses += cycle.presses;
+        }
+    }
+    if (presses > 0) {
+        Serial.printf("A press costs about %.1f uAh, counting the wake up and staying around for the next one\n", pressUc / 3600.0 / presses);
+    }
+
+    double leftMah = ENERGY_BATTERY_MAH - totalNc / 3.6e9;
+    if (batteryMv != 0) {
+        uint8_t percent = batteryPercent(batteryMv);
+        leftMah = ENERGY_BATTERY_MAH * percent / 100.0;
+        Serial.printf("Battery at %u mV, about %u%% full\n", batteryMv, percent);
+    }
+    if (averageUa > 0 && leftMah > 0) {
+        // uAh over uA is hours
+        double hours = leftMah * 1000 / averageUa;
+        Serial.printf("%.0f mAh left of %u, about %.0f days at this rate\n", leftMah, ENERGY_BATTERY_MAH, hours / 24);
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <Arduino.h>
+
+/*
+ * What the board draws in each phase, in uA. These are datasheet figures for a WROOM module plus
+ * the regulator, measure your own board with a meter in series with the battery and put them here
+ */
+// Deep sleep with the RTC peripherals up for the ULP's GPIO reads
+#define ENERGY_DEEP_SLEEP_UA 150
+// Charge each ULP scan of the buttons costs on top, in uA x ms
+#define ENERGY_ULP_SCAN_NC 150
+// CPU running flat out with the radio off, from reset through setup()
+#define ENERGY_BOOT_UA 40000
+// Radio scanning and associating, and getting an address
+#define ENERGY_WIFI_JOIN_UA 120000
+// Radio sending and listening for SSDP answers or HTTP responses
+#define ENERGY_DISCOVERY_UA 110000
+#define ENERGY_HTTP_UA 100000
+// Associated in light modem sleep with the CPU light sleeping, waking every COMMAND_IDLE_WAIT_MS
+#define ENERGY_AWAKE_UA 8000
+// Associated in deep modem sleep, sleeping through beacons
+#define ENERGY_DOZE_UA 1500
+// Each lit LED at LED_BRIGHTNESS, on top of everything else
+#define ENERGY_LED_UA 4000
+// How long the ROM and the second stage bootloader take before the app's clock starts
+#define ENERGY_BOOTLOADER_MS 250
+
+// Capacity of a full battery
+#define ENERGY_BATTERY_MAH 1000
+// ADC1 pin with the battery on it through a divider, -1 if it isn't wired up. ADC2 doesn't work with wifi on
+#define ENERGY_BATTERY_PIN -1
+// The divider halves the battery voltage so it fits the ADC's range
+#define ENERGY_BATTERY_DIVIDER 2
+
+// How many wake cycles we keep a row for
+#define ENERGY_CYCLES 8
+
+typedef enum {
+    ENERGY_DEEP_SLEEP,
+    ENERGY_BOOT,
+    ENERGY_WIFI_JOIN,
+    ENERGY_DISCOVERY,
+    ENERGY_HTTP,
+    ENERGY_AWAKE,
+    ENERGY_DOZE,
+    // LED on-time, counted per LED alongside whatever phase we're in
+    ENERGY_LEDS,
+    ENERGY_PHASES
+} EnergyPhase;
+
+/**
+ * Battery use per phase of a wake cycle, from how long we spend in each phase and what the board
+ * draws in it.
+ *
+ * The time spent in each phase is charged at its ENERGY_*_UA and added up in RTC memory from power
+ * on, when a fresh battery goes in. Deep sleep is timed on the RTC clock from napTime() to the next
+ * wake. Each wake cycle also gets a row with what its sleep and awake time cost and how many presses
+ * it had, so the cost of a press and of staying awake or dozing for it can be compared.
+ * energyDump() projects how long the battery will last at the average current so far, from the
+ * battery voltage if there's an ADC pin for it.
+ *
+ * Phases are switched from setup() and the command task, presses are counted on the scanner and the
+ * LEDs are switched from the scanner and the LEDs' timer, so the accounting is under a spinlock. It's
+ * only ever held for some arithmetic, energyDump() copies everything out before printing any of it.
+ */
+
+// Start a new cycle, charging the deep sleep we just woke from and the boot up to here
+void energyBegin();
+
+// Everything from now on is in phase, until the next switch
+void energyPhase(EnergyPhase phase);
+EnergyPhase energyCurrentPhase();
+
+// lit LEDs are on from now on, leds.cpp calls it whenever that changes
+void energyLeds(uint8_t lit);
+
+// A button press in this cycle
+void energyPress();
+
+// Close the cycle before deep sleep, with the ULP scanning every ulpPeriodUs
+void energySleep(uint32_t ulpPeriodUs);
+
+// Charge in phase since power on, in uA x ms (nC)
+uint64_t energyCharge(EnergyPhase phase);
+
+// Print what each phase has cost, the last few cycles and how long the battery should last over serial
+void energyDump();
+
+// In phase from here to the end of the scope, then back to what we were in before
+class EnergyScope {
+    public:
+        EnergyScope(EnergyPhase phase) : previous(energyCurrentPhase()) { energyPhase(phase); }
+        ~EnergyScope() { energyPhase(previous); }
+    private:
+        EnergyPhase previous;
+};
@@ -0,0 +1,192 @@
+#include <Arduino.h>
+#include <driver/ledc.h>
+#include <esp_timer.h>
+#include <esp_pm.h>
+#include "leds.h"
+#include "energy.h"
+
+#define LED_SPEED_MODE LEDC_HIGH_SPEED_MODE
+#define LED_TIMER LEDC_TIMER_0
+// Fast enough not to flicker, slow enough for 8 bits of duty
+#define LED_FREQ_HZ 5000
+
+static const LedPattern OFF_PATTERN = { LED_OFF, 0, 0 };
+
+// What each LED has been asked to show, and where its blink or breathe is up to
+static LedPattern patterns[LED_COUNT];
+static boolean phase[LED_COUNT];
+static esp_timer_handle_t animations[LED_COUNT];
+
+// LEDs lit by ledsShowLevel until levelTimer goes off
+static uint8_t levelLeds = 0;
+static esp_timer_handle_t levelTimer = NULL;
+
+// Patterns get changed from the scanner, the command task and the timers
+static SemaphoreHandle_t ledsLock = NULL;
+
+// LEDC stops with the APB clock, so hold it up (which also keeps us out of light sleep) while anything is lit
+static uint8_t litLeds = 0;
+#if CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t litLock = NULL;
+#endif
+
+static void setDuty(uint8_t led, uint8_t duty) {
+    ledc_set_duty_and_update(LED_SPEED_MODE, (ledc_channel_t) led, duty, 0);
+}
+
+// Put an LED's pattern on the hardware, call with ledsLock held
+static void render(uint8_t led) {
+    LedPattern pattern = patterns[led];
+    if (bitRead(levelLeds, led)) {
+        pattern = { LED_ON, LED_BRIGHTNESS, 0 };
+    }
+
+    uint8_t wasLit = litLeds;
+    if (pattern.mode == LED_OFF) {
+        bitClear(litLeds, led);
+    } else {
+        bitSet(litLeds, led);
+    }
+    if (wasLit != litLeds) {
+        energyLeds(__builtin_popcount(litLeds));
+    }
+#if CONFIG_PM_ENABLE
+    if (wasLit == 0 && litLeds != 0) {
+        esp_pm_lock_acquire(litLock);
+    } else if (wasLit != 0 && litLeds == 0) {
+        esp_pm_lock_release(litLock);
+    }
+#endif
+
+    esp_timer_stop(animations[led]);
+    phase[led] = true;
+    switch (pattern.mode) {
+        case LED_OFF:
+            setDuty(led, 0);
+            break;
+        case LED_ON:
+            setDuty(led, pattern.brightness);
+            break;
+        case LED_BLINK:
+            setDuty(led, pattern.brightness);
+            esp_timer_start_periodic(animations[led], pattern.periodMs * 1000);
+            break;
+        case LED_BREATHE:
+            ledc_set_fade_time_and_start(LED_SPEED_MODE, (ledc_channel_t) led, pattern.brightness, pattern.periodMs, LEDC_FADE_NO_WAIT);
+            esp_timer_start_periodic(animations[led], pattern.periodMs * 1000);
+            break;
+    }
+}
+
+// Runs every period of a blinking or breathing LED to turn it around
+static void animate(void *arg) {
+    uint8_t led = (intptr_t) arg;
+    xSemaphoreTake(ledsLock, portMAX_DELAY);
+    const LedPattern &pattern = patterns[led];
+    phase[led] = !phase[led];
+    uint8_t duty = phase[led] ? pattern.brightness : 0;
+    if (pattern.mode == LED_BREATHE) {
+        ledc_set_fade_time_and_start(LED_SPEED_MODE, (ledc_channel_t) led, duty, pattern.periodMs, LEDC_FADE_NO_WAIT);
+    } else if (pattern.mode == LED_BLINK) {
+        setDuty(led, duty);
+    }
+    xSemaphoreGive(ledsLock);
+}
+
+static void levelDone(void *arg) {
+    xSemaphoreTake(ledsLock, portMAX_DELAY);
+    uint8_t was = levelLeds;
+    levelLeds = 0;
+    for (uint8_t i = 0; i < LED_COUNT; i++) {
+        if (bitRead(was, i)) {
+            render(i);
+        }
+    }
+    xSemaphoreGive(ledsLock);
+}
+
+void ledsBegin(const gpio_num_t *columns, const gpio_num_t *rows, uint8_t rowCount) {
+    ledsLock = xSemaphoreCreateMutex();
+#if CONFIG_PM_ENABLE
+    esp_pm_lock_create(ESP_PM_APB_FREQ_MAX, 0, "leds", &litLock);
+#endif
+
+    // A single row means every column can be driven at once, so the row just stays enabled
+    for (uint8_t i = 0; i < rowCount; i++) {
+        pinMode(rows[i], OUTPUT);
+        digitalWrite(rows[i], LOW);
+    }
+
+    ledc_timer_config_t timer = {};
+    timer.speed_mode = LED_SPEED_MODE;
+    timer.duty_resolution = LEDC_TIMER_8_BIT;
+    timer.timer_num = LED_TIMER;
+    timer.freq_hz = LED_FREQ_HZ;
+    ledc_timer_config(&timer);
+    ledc_fade_func_install(0);
+
+    for (uint8_t i = 0; i < LED_COUNT; i++) {
+        ledc_channel_config_t channel = {};
+        channel.gpio_num = columns[i];
+        channel.speed_mode = LED_SPEED_MODE;
+        channel.channel = (ledc_channel_t) i;
+        channel.intr_type = LEDC_INTR_DISABLE;
+        channel.timer_sel = LED_TIMER;
+        channel.duty = 0;
+        ledc_channel_config(&channel);
+
+        esp_timer_create_args_t args = {};
+        args.callback = animate;
+        args.arg = (void *) (intptr_t) i;
+        args.name = "led";
+        esp_timer_create(&args, &animations[i]);
+        patterns[i] = OFF_PATTERN;
+    }
+
+    esp_timer_create_args_t args = {};
+    args.callback = levelDone;
+    args.name = "ledlevel";
+    esp_timer_create(&args, &levelTimer);
+}
+
+void ledsSet(uint8_t leds, const LedPattern &pattern) {
+    xSemaphoreTake(ledsLock, portMAX_DELAY);
+    for (uint8_t i = 0; i < LED_COUNT; i++) {
+        if (!bitRead(leds, i)) {
+            continue;
+        }
+        // Leave animations running if nothing changed
+        const LedPattern &current = patterns[i];
+        if (current.mode != pattern.mode || current.brightness != pattern.brightness || current.periodMs != pattern.periodMs) {
+            patterns[i] = pattern;
+            render(i);
+        }
+    }
+    xSemaphoreGive(ledsLock);
+}
+
+void ledsOn(uint8_t leds) {
+    ledsSet(leds, { LED_ON, LED_BRIGHTNESS, 0 });
+}
+
+void ledsOff(uint8_t leds) {
+    ledsSet(leds, OFF_PATTERN);
+}
+
+void ledsShowLevel(int level, uint32_t ms) {
+    int count = (level * LED_COUNT + 99) / 100;
+    if (count < 1) {
+        count = 1;
+    }
+    xSemaphoreTake(ledsLock, portMAX_DELAY);
+    uint8_t was = levelLeds;
+    levelLeds = (1 << count) - 1;
+    for (uint8_t i = 0; i < LED_COUNT; i++) {
+        if (bitRead(was ^ levelLeds, i)) {
+            render(i);
+        }
+    }
+    esp_timer_stop(levelTimer);
+    esp_timer_start_once(levelTimer, ms * 1000);
+    xSemaphoreGive(ledsLock);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Arduino.h>
+#include <driver/gpio.h>
+
+// One LEDC channel per LED column
+#define LED_COUNT 4
+// Duty out of 255 for a lit LED
+#define LED_BRIGHTNESS 192
+
+typedef enum {
+    LED_OFF,
+    LED_ON,
+    // On for periodMs, off for periodMs
+    LED_BLINK,
+    // Fades up over periodMs and back down over periodMs
+    LED_BREATHE
+} LedMode;
+
+typedef struct {
+    LedMode mode;
+    uint8_t brightness;
+    uint16_t periodMs;
+} LedPattern;
+
+/**
+ * LED pattern engine on the LEDC peripheral.
+ *
+ * Every LED column gets its own LEDC channel and the row line is held low, so a steady LED costs
+ * no CPU time at all once its duty is set. Blinking and breathing LEDs get a timer that flips them
+ * every period, breathing ones fading in hardware. Nothing here runs unless a pattern changes or
+ * is animating.
+ */
+
+// Take over the LED pins, everything starts off
+void ledsBegin(const gpio_num_t *columns, const gpio_num_t *rows, uint8_t rowCount);
+
+// Show pattern on every LED in the leds bit field
+void ledsSet(uint8_t leds, const LedPattern &pattern);
+
+// Shorthands for ledsSet with a steady LED_BRIGHTNESS or off
+void ledsOn(uint8_t leds);
+void ledsOff(uint8_t leds);
+
+// Light one LED per quarter of level (0-100) for ms, on top of whatever the LEDs were showing
+void ledsShowLevel(int level, uint32_t ms);
@@ -0,0 +1,35 @@
+#include <Arduino.h>
+#include <atomic>
+#include "press_queue.h"
+
+static PressEvent events[PRESS_QUEUE_SIZE];
+// head is only written by the producer and tail only by the consumer. They count up forever and
+// get masked on use, so head == tail is empty and head - tail == PRESS_QUEUE_SIZE is full.
+static std::atomic<uint32_t> head(0);
+static std::atomic<uint32_t> tail(0);
+
+boolean pressQueuePush(const PressEvent &event) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= PRESS_QUEUE_SIZE) {
+        return false;
+    }
+    events[h & (PRESS_QUEUE_SIZE - 1)] = event;
+    // Publish the event only once it's been written
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+boolean pressQueuePop(PressEvent *event) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    *event = events[t & (PRESS_QUEUE_SIZE - 1)];
+    // Hand the slot back to the producer only once we've copied it out
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+boolean pressQueueEmpty() {
+    return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+}
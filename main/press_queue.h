@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Must be a power of two so the indexes can wrap with a mask
+#define PRESS_QUEUE_SIZE 32
+
+// What the button did, worked out by the scanner from how long it was held and how soon it was pressed again
+typedef enum {
+    GESTURE_TAP,
+    // A second tap on the same button straight after the first, which has already been queued as a tap
+    GESTURE_DOUBLE_TAP,
+    // Held down past LONG_PRESS_MS and then let go
+    GESTURE_LONG_PRESS,
+    // Buttons that ramp get these instead of a long press, as soon as they've been held for HOLD_MS and when they're let go
+    GESTURE_HOLD_START,
+    GESTURE_HOLD_END
+} Gesture;
+
+typedef struct {
+    // Button number, column * NUM_BTN_ROWS + row
+    uint8_t button;
+    Gesture gesture;
+    // millis() when the gesture was detected
+    unsigned long at;
+} PressEvent;
+
+/**
+ * Lock-free single producer/single consumer ring buffer of button presses.
+ *
+ * The button scanner is the only producer and the command task is the only consumer, so the two
+ * never have to wait on each other: the scanner keeps running at full rate no matter how long the
+ * player takes to answer, and nothing it detects gets overwritten before it's been handled.
+ */
+
+// Queue a press, returns false if the queue is full. Only call from the producer.
+boolean pressQueuePush(const PressEvent &event);
+
+// Take the oldest press, returns false if there isn't one. Only call from the consumer.
+boolean pressQueuePop(PressEvent *event);
+
+boolean pressQueueEmpty();
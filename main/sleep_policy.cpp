@@ -0,0 +1,130 @@
+#include <Arduino.h>
+#include <string.h>
+#include <time.h>
+#include "sleep_policy.h"
+
+#define SLEEP_MAGIC 0x534c5050
+
+static RTC_DATA_ATTR struct {
+    uint32_t magic;
+    // time() of the last press, the RTC clock keeps counting through deep sleep
+    uint32_t lastPress;
+    uint8_t gaps[SLEEP_GAP_BUCKETS];
+    uint16_t total;
+} history;
+
+static void checkHistory() {
+    if (history.magic != SLEEP_MAGIC) {
+        memset(&history, 0, sizeof(history));
+        history.magic = SLEEP_MAGIC;
+    }
+}
+
+// Bucket i holds gaps of 2^i up to 2^(i+1) seconds
+static uint8_t gapBucket(uint32_t seconds) {
+    uint8_t bucket = 0;
+    while (seconds > 1 && bucket < SLEEP_GAP_BUCKETS - 1) {
+        seconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Where a bucket ends, in ms
+static uint32_t bucketEndMs(uint8_t bucket) {
+    return (2UL << bucket) * 1000;
+}
+
+void sleepPolicyPress() {
+    checkHistory();
+    uint32_t now = time(NULL);
+    if (history.lastPress != 0 && now > history.lastPress) {
+        history.gaps[gapBucket(now - history.lastPress)]++;
+        history.total++;
+        if (history.total >= SLEEP_GAP_DECAY_AT) {
+            history.total = 0;
+            for (uint8_t i = 0; i < SLEEP_GAP_BUCKETS; i++) {
+                history.gaps[i] /= 2;
+                history.total += history.gaps[i];
+            }
+        }
+    }
+    history.lastPress = now;
+}
+
+static uint16_t gapsFrom(uint8_t start) {
+    uint16_t total = 0;
+    for (uint8_t i = start; i < SLEEP_GAP_BUCKETS; i++) {
+        total += history.gaps[i];
+    }
+    return total;
+}
+
+// The end of the first bucket from start where percent of the gaps from start on have ended
+static uint8_t coveringBucket(uint8_t start, uint8_t percent) {
+    uint16_t total = gapsFrom(start);
+    uint16_t seen = 0;
+    for (uint8_t i = start; i < SLEEP_GAP_BUCKETS; i++) {
+        seen += history.gaps[i];
+        if (seen * 100 >= total * percent) {
+            return i;
+        }
+    }
+    return SLEEP_GAP_BUCKETS - 1;
+}
+
+// Percent of the gaps from bucket start on that are over by the end of bucket last
+static uint8_t coverage(uint8_t start, int last) {
+    uint16_t total = gapsFrom(start);
+    uint16_t covered = 0;
+    for (int i = start; i <= last && i < SLEEP_GAP_BUCKETS; i++) {
+        covered += history.gaps[i];
+    }
+    return total == 0 ? 100 : covered * 100 / total;
+}
+
+SleepPolicy sleepPolicyChoose() {
+    checkHistory();
+    SleepPolicy policy = { SLEEP_DEFAULT_AWAKE_MS, SLEEP_DEFAULT_DOZE_MS, SLEEP_ULP_NORMAL_US, 0 };
+    if (history.total < SLEEP_MIN_HISTORY) {
+        return policy;
+    }
+
+    // Stay fully awake through the typical gap inside a burst
+    policy.awakeMs = constrain(bucketEndMs(coveringBucket(0, 50)), SLEEP_AWAKE_MIN_MS, SLEEP_AWAKE_MAX_MS);
+
+    // Then doze through most of the gaps that outlast that. Buckets start where the one before ends,
+    // so the gaps over by a boundary are the ones in the buckets before the boundary's own
+    uint8_t awakeBucket = gapBucket(policy.awakeMs / 1000);
+    uint8_t dozeBucket = coveringBucket(awakeBucket, SLEEP_DOZE_COVERAGE);
+    uint32_t dozeEnd = constrain(bucketEndMs(dozeBucket), policy.awakeMs, SLEEP_DOZE_MAX_MS);
+    policy.dozeMs = dozeEnd - policy.awakeMs;
+    uint8_t afterDoze = gapBucket(dozeEnd / 1000);
+    policy.dozeCoverage = coverage(awakeBucket, afterDoze - 1);
+
+    // Scan faster in deep sleep when the gaps that outlast the doze mostly end within the hour,
+    // slower when they're mostly overnight
+    if (gapsFrom(afterDoze) > 0) {
+        uint8_t soon = coverage(afterDoze, gapBucket(SLEEP_ULP_SOON_S) - 1);
+        if (soon >= 50) {
+            policy.ulpPeriodUs = SLEEP_ULP_FAST_US;
+        } else if (soon < 20) {
+            policy.ulpPeriodUs = SLEEP_ULP_SLOW_US;
+        }
+    }
+    return policy;
+}
+
+void sleepPolicyDump() {
+    checkHistory();
+    Serial.printf("Gaps between presses (%u):\n", history.total);
+    for (uint8_t i = 0; i < SLEEP_GAP_BUCKETS; i++) {
+        if (history.gaps[i] > 0) {
+            Serial.printf("  %6lus-%6lus %3u\n", 1UL << i, 2UL << i, history.gaps[i]);
+        }
+    }
+    SleepPolicy policy = sleepPolicyChoose();
+    Serial.printf("Awake %lus, then associated in modem sleep for %lus (%u%% of later presses skip the wifi join), ULP every %lums\n",
+        (unsigned long) policy.awakeMs / 1000, (unsigned long) policy.dozeMs / 1000, policy.dozeCoverage,
+        (unsigned long) policy.ulpPeriodUs / 1000);
+}
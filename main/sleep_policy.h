@@ -0,0 +1,55 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Gaps between presses are counted in power of two buckets of seconds, 1s up to about 18 hours
+#define SLEEP_GAP_BUCKETS 16
+// Halve the counts once there are this many, so old habits fade out
+#define SLEEP_GAP_DECAY_AT 255
+
+// Bounds on how long we stay fully awake (subscribed to events, wifi in light modem sleep)
+#define SLEEP_AWAKE_MIN_MS 10000
+#define SLEEP_AWAKE_MAX_MS 60000
+// The longest we stay associated after the last press, dozing in deep modem sleep after the awake window
+#define SLEEP_DOZE_MAX_MS 600000
+// Doze long enough that this many percent of the presses after the awake window still find wifi up
+#define SLEEP_DOZE_COVERAGE 80
+// Used until we've seen enough gaps to go on
+#define SLEEP_DEFAULT_AWAKE_MS 30000
+#define SLEEP_DEFAULT_DOZE_MS 120000
+#define SLEEP_MIN_HISTORY 8
+
+// ULP scan periods in deep sleep, faster when the next press is likely to be soon
+#define SLEEP_ULP_FAST_US 50000
+#define SLEEP_ULP_NORMAL_US 100000
+#define SLEEP_ULP_SLOW_US 250000
+// What counts as soon for picking the ULP period
+#define SLEEP_ULP_SOON_S 3600
+
+typedef struct {
+    // Fully awake for this long after the last press
+    uint32_t awakeMs;
+    // Then associated in modem sleep for this much longer
+    uint32_t dozeMs;
+    // Then deep sleep, with the ULP scanning this often
+    uint32_t ulpPeriodUs;
+    // Of the gaps we've seen longer than awakeMs, how many percent ended before dozeMs ran out
+    uint8_t dozeCoverage;
+} SleepPolicy;
+
+/**
+ * Sleep tiers picked from how we actually use the buttons.
+ *
+ * Presses come in bursts with long quiet stretches between, so the gaps between presses are kept
+ * in RTC memory as a histogram and the tiers get stretched to cover the gaps that usually happen:
+ * staying associated costs a little current, but a press after deep sleep costs a full wifi join.
+ */
+
+// Count the gap since the last press
+void sleepPolicyPress();
+
+// Pick the tiers from the history so far
+SleepPolicy sleepPolicyChoose();
+
+// Print the gap histogram and the policy it gives over serial
+void sleepPolicyDump();
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <Arduino.h>
+#include <string.h>
+
+/**
+ * SOAP envelopes for the UPnP actions we send, put together by the preprocessor.
+ *
+ * Every constant part of a request is a string literal that lives in flash. Actions without
+ * arguments we need to fill in are sent straight from there; the rest are split around their one
+ * variable field, which soapFill() writes into a caller's stack buffer along with the constant
+ * parts. Nothing on the request path touches the heap.
+ */
+
+#define SOAP_ENVELOPE_START "<?xml version=\"1.0\"?>" \
+    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">" \
+        "<s:Body>"
+#define SOAP_ENVELOPE_END \
+        "</s:Body>" \
+    "</s:Envelope>"
+
+#define SOAP_SERVICE(service) "urn:schemas-upnp-org:service:" service ":1"
+
+#define SOAP_ACTION_START(service, action) SOAP_ENVELOPE_START "<u:" action " xmlns:u=\"" SOAP_SERVICE(service) "\">"
+#define SOAP_ACTION_END(action) "</u:" action ">" SOAP_ENVELOPE_END
+
+// Big enough for any filled in template, checked against each of them with a static_assert
+#define SOAP_MAX_BODY 512
+// Room for the variable field, an int with its sign
+#define SOAP_MAX_FIELD 11
+
+typedef struct {
+    const char *path;
+    // Value of the SOAPACTION header
+    const char *soapAction;
+    const char *body;
+    size_t length;
+} SoapAction;
+
+// An action with one integer argument, sent as head + value + tail
+typedef struct {
+    const char *path;
+    const char *soapAction;
+    const char *head;
+    size_t headLength;
+    const char *tail;
+    size_t tailLength;
+} SoapTemplate;
+
+// A complete action with a fixed set of arguments
+#define SOAP_ACTION(path, service, action, args) { \
+    path, \
+    SOAP_SERVICE(service) "#" action, \
+    SOAP_ACTION_START(service, action) args SOAP_ACTION_END(action), \
+    sizeof(SOAP_ACTION_START(service, action) args SOAP_ACTION_END(action)) - 1 \
+}
+
+// An action whose last argument is the element field, filled in with soapFill()
+#define SOAP_TEMPLATE(path, service, action, args, field) { \
+    path, \
+    SOAP_SERVICE(service) "#" action, \
+    SOAP_ACTION_START(service, action) args "<" field ">", \
+    sizeof(SOAP_ACTION_START(service, action) args "<" field ">") - 1, \
+    "</" field ">" SOAP_ACTION_END(action), \
+    sizeof("</" field ">" SOAP_ACTION_END(action)) - 1 \
+}
+
+#define SOAP_TEMPLATE_FITS(t) ((t).headLength + SOAP_MAX_FIELD + (t).tailLength < SOAP_MAX_BODY)
+
+// Fill a template into buf, which should be SOAP_MAX_BODY long. Returns the body length.
+static inline size_t soapFill(const SoapTemplate &t, int value, char *buf) {
+    memcpy(buf, t.head, t.headLength);
+    size_t len = t.headLength;
+
+    // Write the digits backwards into the end of the field's space then slide them into place
+    char digits[SOAP_MAX_FIELD];
+    size_t pos = sizeof(digits);
+    unsigned int magnitude = value < 0 ? -(unsigned int) value : value;
+    do {
+        digits[--pos] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        digits[--pos] = '-';
+    }
+    memcpy(buf + len, digits + pos, sizeof(digits) - pos);
+    len += sizeof(digits) - pos;
+
+    memcpy(buf + len, t.tail, t.tailLength);
+    len += t.tailLength;
+    buf[len] = '\0';
+    return len;
+}
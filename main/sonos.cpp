@@ -1,11 +1,17 @@
 #include <Arduino.h>
-#include <HTTPClient.h>
-#include <AsyncUDP.h>
 #include <AsyncUDP.h>
 #include <string.h>
-#include <expat.h>
-#include <Preferences.h>
 #include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_events.h"
+#include "soap.h"
+#include "sonos_xml.h"
+#include "sonos_topology.h"
+#include "sonos_trace.h"
+#include "sonos_memory.h"
+#include "energy.h"
+
+static_assert(SONOS_FANOUT_MAX >= SONOS_TOPOLOGY_MAX, "A fan-out should reach the whole household");
 
 static const char* PLAYER_SEARCH = "M-SEARCH * HTTP/1.1\r\n"
     "HOST: 239.255.255.250:1900\r\n"
@@ -13,386 +19,501 @@ static const char* PLAYER_SEARCH = "M-SEARCH * HTTP/1.1\r\n"
     "MX: 1\r\n"
     "ST: urn:schemas-upnp-org:device:ZonePlayer:1\r\n";
 
-static std::string soapCall(std::string operation) {
-    return "<?xml version=\"1.0\"?>"  
-        "<s:Envelope s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\" xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\">" 
-          "<s:Body>"  
-            "<u:" + operation + " xmlns:u=\"urn:schemas-upnp-org:service:AVTransport:1\">" 
-              "<InstanceID>0</InstanceID>"  
-              "<Speed>1</Speed>"  
-            "</u:" + operation + ">" 
-          "</s:Body>"  
-        "</s:Envelope>";
-}
-
-static const std::string GET_VOLUME_CALL = "<?xml version=\"1.0\"?>"
-    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-        "<s:Body>"
-            "<u:GetVolume xmlns:u=\"urn:schemas-upnp-org:service:RenderingControl:1\">"
-                "<InstanceID>0</InstanceID>"
-                "<Channel>Master</Channel>"
-            "</u:GetVolume>"
-        "</s:Body>"
-    "</s:Envelope>";
-
-static std::string changeVolumeCall(int volume) {
-    return "<?xml version=\"1.0\"?>"
-    "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-        "<s:Body>"
-            "<u:SetVolume xmlns:u=\"urn:schemas-upnp-org:service:RenderingControl:1\">"
-                "<InstanceID>0</InstanceID>"
-                "<Channel>Master</Channel>"
-                "<DesiredVolume>" + std::string(String(volume).c_str()) + "</DesiredVolume>"
-            "</u:GetVolume>"
-        "</s:Body>"
-    "</s:Envelope>";
-}
-
-std::string tagValue(std::string xmlData, std::string tagName) {
-
-    typedef struct state {
-        std::string captured;
-        boolean capturing;
-        std::string tagName;
-    } ParseState;
-
-    std::string captured;
-
-    ParseState state = {
-        captured,
-        false,
-        tagName
-    };
-
-    XML_StartElementHandler start = [](void *myState, const char *el, const char **attr) {
-        ParseState *d = (ParseState*) myState;
-        if (strncmp(el, d->tagName.c_str(), d->tagName.length()) == 0) {
-            d->capturing = true;
-        }
-    };
-    XML_EndElementHandler end = [](void *myState, const char *el) {
-        ParseState *d = (ParseState*) myState;
-        d->capturing = false;
-    };
-    XML_CharacterDataHandler charData = [](void *myState, const char *s, int len) {
-        ParseState *d = (ParseState*) myState;
-        if (d->capturing) {
-            d->captured += std::string(s, len);
-        }
-    };
-    XML_Parser p = XML_ParserCreate(NULL);
-    if (! p) {
-        Serial.println("Couldn't allocate parser");
-    } else {
-        XML_SetUserData(p, &state);
-        XML_SetElementHandler(p, start, end);
-        XML_SetCharacterDataHandler(p, charData);
-        XML_Parse(p, xmlData.c_str(), xmlData.length(), true);
-        XML_ParserFree(p);
-    }
-    return state.captured;
-
-}
-
-// Find the Location attribute for the player specified by uid
-std::string filterDeviceLocation(std::string xmlData, std::string targetUid) {
-    typedef struct state {
-        std::string location;
-        std::string targetUid;
-    } ParseState;
-
-    std::string location;
-
-    ParseState state = {
-        location,
-        targetUid
-    };
-
-    XML_StartElementHandler start = [](void *myState, const char *el, const char **attr) {
-        ParseState *state = (ParseState *) myState;
-        // 15 is ZoneGroupMember length
-        if (strncmp(el, "ZoneGroupMember", 15) == 0) {
-            std::string loc;
-            std::string uid;
-
-            for (int i = 0;; i += 2) {
-                const char *key = attr[i];
-                if (key == NULL) {
-                    break;
-                }
-                const char *value = attr[i + 1];
-                if (value == NULL) {
-                    break;
-                }
-
-                if (strncmp(key, "UUID", 4) == 0) {
-                    uid = std::string(value);
-                } else if (strncmp(key, "Location", 8) == 0) {
-                    loc = std::string(value);
-                }
-            }
-            
-            if (loc.length() > 0 && (uid == state->targetUid)) {
-                state->location += loc;
-            }
-        }
-    };
-
-    XML_Parser p = XML_ParserCreate(NULL);
-    if (! p) {
-        Serial.println("Couldn't allocate parser");
-    } else {
-        XML_SetUserData(p, &state);
-        XML_SetElementHandler(p, start, NULL);
-        XML_Parse(p, xmlData.c_str(), xmlData.length(), true);
-        XML_ParserFree(p);
-    }
-
-    return state.location;
-}
-
-
-/**
- * Given any sonos' address, ask it for the zone topology to find the right sonos
- */
-IPAddress zoneTopology(HTTPClient *http, std::string host, std::string targetUid) {
-    auto postBody = soapCall("GetZoneGroupState");
-
-    IPAddress ipaddr;
-
-    if (http->begin(host.c_str(), SONOS_PORT, "/ZoneGroupTopology/Control")) {
-        http->addHeader("Content-Type", "text/xml; charset=\"utf-8\"");
-        http->addHeader("SOAPACTION", "urn:schemas-upnp-org:service:ZoneGroupTopology:1#GetZoneGroupState");
-        int httpCode = http->POST(postBody.c_str());
-        if (httpCode == 200) {
-            // The body here is an XML doc embedded in the body of another, so just pull out the first one, then run it through the next parser
-            std::string innerXml = tagValue(std::string(http->getString().c_str()), "ZoneGroupState");
-            std::string locationUrl = filterDeviceLocation(innerXml, targetUid);
-            if (locationUrl.length() > 0 && locationUrl.length() > 7) {
-                Serial.printf("Found location: %s\n", locationUrl.c_str());
-
-                int pos = locationUrl.find(":", 7);
-                if (pos > 0) {
-                    ipaddr.fromString(locationUrl.substr(7, pos - 7).c_str());
-                }
-            }
-            if (!ipaddr) {
-                Serial.println("Couldn't find location descriptor for sonos");
-            }
-        } else {
-            Serial.printf("Got bad status code getting zone topology %d: %s\n", httpCode, http->getString().c_str());
-        }
-    }
-    return ipaddr;
-}
+#define AVTRANSPORT_PATH "/MediaRenderer/AVTransport/Control"
+#define RENDERING_CONTROL_PATH "/MediaRenderer/RenderingControl/Control"
+
+static constexpr SoapAction GET_TRANSPORT_INFO = SOAP_ACTION(AVTRANSPORT_PATH, "AVTransport", "GetTransportInfo",
+    "<InstanceID>0</InstanceID>");
+static constexpr SoapAction PLAY = SOAP_ACTION(AVTRANSPORT_PATH, "AVTransport", "Play",
+    "<InstanceID>0</InstanceID>"
+    "<Speed>1</Speed>");
+static constexpr SoapAction PAUSE = SOAP_ACTION(AVTRANSPORT_PATH, "AVTransport", "Pause",
+    "<InstanceID>0</InstanceID>");
+static constexpr SoapAction NEXT = SOAP_ACTION(AVTRANSPORT_PATH, "AVTransport", "Next",
+    "<InstanceID>0</InstanceID>");
+static constexpr SoapAction PREVIOUS = SOAP_ACTION(AVTRANSPORT_PATH, "AVTransport", "Previous",
+    "<InstanceID>0</InstanceID>");
+
+static constexpr SoapTemplate SET_RELATIVE_VOLUME = SOAP_TEMPLATE(RENDERING_CONTROL_PATH, "RenderingControl", "SetRelativeVolume",
+    "<InstanceID>0</InstanceID>"
+    "<Channel>Master</Channel>",
+    "Adjustment");
+static_assert(SOAP_TEMPLATE_FITS(SET_RELATIVE_VOLUME), "SetRelativeVolume doesn't fit in SOAP_MAX_BODY");
 
 IPAddress discoverSonos(std::string uid) {
+    MemoryScope memory(MEM_OP_DISCOVERY);
+    EnergyScope radio(ENERGY_DISCOVERY);
+    traceMark(TRACE_DISCOVERY_START);
 
     AsyncUDP udp;
-    IPAddress foundAddr;
     IPAddress targetSonos;
+    // Shared with the packet callback, which runs on the async udp task
+    struct {
+        IPAddress foundAddr;
+        SemaphoreHandle_t found;
+    } search = { IPAddress(), xSemaphoreCreateBinary() };
+    if (search.found == NULL) {
+        Serial.println("Couldn't allocate discovery semaphore");
+        return targetSonos;
+    }
+
     if (udp.listenMulticast(IPAddress(239, 255, 255, 250), 1900)) {
         Serial.println("UDP connected");
-        udp.onPacket([&foundAddr](AsyncUDPPacket packet) {
-            if (!foundAddr) {
-                auto s = std::string((char*) packet.data());
+        udp.onPacket([&search](AsyncUDPPacket packet) {
+            if (!search.foundAddr) {
+                auto s = std::string((char*) packet.data(), packet.length());
                 // All we care about here is finding a sonos, any sonos.
-                if (s.find("Sonos") > 0) {
-                    foundAddr = packet.remoteIP();
-                }   
+                if (s.find("Sonos") != std::string::npos) {
+                    search.foundAddr = packet.remoteIP();
+                    xSemaphoreGive(search.found);
+                }
             } else {
                 Serial.printf("Got duplicate announcement from %s\n", packet.remoteIP().toString().c_str());
             }
         });
-        for (uint8_t i = 0; i < 4 && !foundAddr; i++) {
+
+        // Wake up the moment anything answers, only sending the search again if nothing has
+        unsigned long start = millis();
+        unsigned long wait = SSDP_FIRST_WAIT_MS;
+        boolean found = false;
+        for (uint8_t i = 0; i < SSDP_ATTEMPTS && !found; i++) {
+            unsigned long sent = millis();
             udp.broadcast(PLAYER_SEARCH);
-            delay(250);
+            found = xSemaphoreTake(search.found, pdMS_TO_TICKS(wait)) == pdTRUE;
+            Serial.printf("SSDP attempt %d: %s after %lu ms (%lu ms total)\n", i + 1,
+                found ? "answered" : "no answer", millis() - sent, millis() - start);
+            wait *= 2;
         }
-        if (foundAddr) {
-            Serial.printf("Found a sonos address %s\n", foundAddr.toString().c_str());
+        // Stop the callback before the search state goes out of scope
+        udp.close();
 
-            // Now we need to ask whatever sonos we found about the topology to find what we care about
-            HTTPClient http;
-            http.setConnectTimeout(HTTP_TIMEOUT);
-            http.setTimeout(HTTP_TIMEOUT);
+        if (found) {
+            IPAddress foundAddr = search.foundAddr;
+            Serial.printf("Found a sonos address %s\n", foundAddr.toString().c_str());
 
-            IPAddress ourSonos = zoneTopology(&http, std::string(foundAddr.toString().c_str()), uid);
+            // Now we need to ask whatever sonos we found about the topology to find what we care about,
+            // which also saves the whole household for next time
+            unsigned long topologyStart = millis();
+            IPAddress ourSonos = sonosTopologyRefresh(foundAddr, uid.c_str());
+            Serial.printf("Zone topology took %lu ms\n", millis() - topologyStart);
             if (ourSonos) {
                 Serial.printf("FOUND OUR SONOS at %s\n", ourSonos.toString().c_str());
                 targetSonos = ourSonos;
-                // Save our findings in flash across boots
-                Preferences prefs;
-                prefs.begin("sonos");
-                prefs.putString("playerAddress", targetSonos.toString());
-                prefs.putString("playerUid", String(uid.c_str()));
-                prefs.end();
             }
-            http.end();
         } else {
             Serial.println("Nope, didn't find anything");
         }
-        udp.close();
     }
+    vSemaphoreDelete(search.found);
+    traceMark(TRACE_DISCOVERY_DONE);
     return targetSonos;
 }
 
-int sonosOperation(int (*operation)(HTTPClient *http, IPAddress target), IPAddress targetSonos) {
-    HTTPClient http;
-    http.setReuse(false);
-    http.setConnectTimeout(HTTP_TIMEOUT);
-    http.setTimeout(HTTP_TIMEOUT);
-    
-    int errorCode = operation(&http, targetSonos);
-    if (errorCode) {
-        // I think we just care about noticing that we might have to rediscover the sonos but punt for now
-        Serial.printf("Got error from sonos operation %d\n", errorCode);
+// Log an error response's body a piece at a time, so an operation's error path doesn't go over its memory budget
+static void printBody(SonosConnection *conn) {
+    char buf[128];
+    int count;
+    Serial.print("BODY: ");
+    while ((count = conn->read(buf, sizeof(buf))) > 0) {
+        Serial.printf("%.*s", count, buf);
     }
-    http.end();
-    return errorCode;
+    Serial.printf("\n");
+}
+
+// The coordinator of the player's group as far as we know. Topology events that have come in go first, a regrouped
+// coordinator would take the command for its new group without complaint
+static IPAddress transportCoordinator(IPAddress targetSonos) {
+    sonosEventsCatchUp();
+    return sonosTopologyCoordinator(targetSonos);
 }
 
-std::string playState(HTTPClient *http, IPAddress targetSonos) {
-    auto postBody = soapCall("GetTransportInfo");
-
-    if (http->begin(targetSonos.toString(), SONOS_PORT, "/MediaRenderer/AVTransport/Control")) {
-        Serial.printf("POST: BODY %s\n", postBody.c_str());
-        http->addHeader("Content-Type", "text/xml; charset=\"utf-8\"");
-        http->addHeader("SOAPACTION", "urn:schemas-upnp-org:service:AVTransport:1#GetTransportInfo");
-
-        int httpCode = http->POST(postBody.c_str());
-        if (httpCode == 200) {
-            /* We're going to get back a soap response like this:
-                <?xml version="1.0"?>
-                <s:Envelope xmlns:s="http://schemas.xmlsoap.org/soap/envelope/" s:encodingStyle="http://schemas.xmlsoap.org/soap/encoding/">
-                  <s:Body>
-                    <u:GetTransportInfoResponse xmlns:u="urn:schemas-upnp-org:service:AVTransport:1">
-                      <CurrentTransportState>PLAYING</CurrentTransportState>
-                      <CurrentTransportStatus>OK</CurrentTransportStatus>
-                      <CurrentSpeed>1</CurrentSpeed>
-                    </u:GetTransportInfoResponse>
-                  </s:Body>
-                </s:Envelope>
-             */
-            return tagValue(std::string(http->getString().c_str()), "CurrentTransportState");
+/*
+ * AVTransport actions only work on the coordinator of the player's group, the other members answer them with a UPnP
+ * error. If the coordinator turns us down or has gone away our idea of the groups may be stale, so check with the
+ * player itself and try again if the coordinator has changed. Leaves the response on *connOut.
+ */
+static int postTransport(IPAddress targetSonos, const SoapAction &action, SonosConnection **connOut) {
+    IPAddress coordinator = transportCoordinator(targetSonos);
+    SonosConnection *conn = sonosConnection(coordinator);
+    int httpCode = conn->post(action);
+    if (httpCode == 500 || (httpCode < 0 && httpCode != SONOS_ERROR_CANCELLED && httpCode != SONOS_ERROR_TIMEOUT && coordinator != targetSonos)) {
+        Serial.printf("%s turned down %s with %d, checking the groups\n", coordinator.toString().c_str(), action.soapAction, httpCode);
+        if (httpCode > 0) {
+            printBody(conn);
+            conn->finish();
         } else {
-            Serial.printf("Got http error code %d body: %s\n", httpCode, http->getString().c_str());
+            conn->close();
+        }
+        if (sonosTopologyUpdate(targetSonos) && sonosTopologyCoordinator(targetSonos) != coordinator) {
+            coordinator = sonosTopologyCoordinator(targetSonos);
+            Serial.printf("Coordinator is now %s\n", coordinator.toString().c_str());
+            conn = sonosConnection(coordinator);
+            httpCode = conn->post(action);
         }
-    } else {
-        Serial.printf("Couldn't connect to %s\n", targetSonos.toString().c_str());
     }
-    return "";
+    *connOut = conn;
+    return httpCode;
 }
 
-int sonosPlay(HTTPClient *http, IPAddress targetSonos) {
-    std::string currentState = playState(http, targetSonos);
-    Serial.printf("Current play state is %s\n", currentState.c_str());
+// A cancelled command that had already gone out has most likely been carried out, we just stopped waiting to hear
+// back, so that counts as done with an unknown result. One that hadn't is ENO_CANCELLED
+static int cancelled(SonosConnection *conn) {
+    boolean sent = conn->requestSent();
+    Serial.printf("Cancelled by a newer press, %s\n", sent ? "after it went out" : "before it went out");
+    return sent ? 0 : ENO_CANCELLED;
+}
 
-    std::string requestState = currentState == "PLAYING" ? "Pause" : "Play";
-    auto postBody = soapCall(requestState);
+// Whether the request that failed the last operation never went out
+static boolean unsent = false;
+
+// What an operation returns for a request that failed with a SONOS_ERROR_*. Only a player we couldn't get through
+// to at all is ENO_CANTCONNECT, one that's slow to answer is still where we think it is
+static int requestFailed(SonosConnection *conn, int httpCode) {
+    if (httpCode == SONOS_ERROR_CANCELLED) {
+        return cancelled(conn);
+    } else if (httpCode == SONOS_ERROR_TIMEOUT) {
+        Serial.printf("%s didn't answer in time\n", conn->address().toString().c_str());
+        return ENO_TIMEOUT;
+    }
+    Serial.println("Couldn't connect to sonos, maybe need to re-discover");
+    unsent = !conn->requestSent();
+    return ENO_CANTCONNECT;
+}
 
-    if (http->begin(targetSonos.toString(), SONOS_PORT, "/MediaRenderer/AVTransport/Control")) {
-        Serial.printf("POST: BODY %s\n", postBody.c_str());
-        http->addHeader("Content-Type", "text/xml; charset=\"utf-8\"");
-        http->addHeader("SOAPACTION", ("urn:schemas-upnp-org:service:AVTransport:1#" + requestState).c_str());
+static MemoryOp memoryOp(SonosOperation operation) {
+    if (operation == sonosPlay) {
+        return MEM_OP_PLAY;
+    } else if (operation == changeVolume) {
+        return MEM_OP_VOLUME;
+    }
+    return MEM_OP_SKIP;
+}
 
-        int httpCode = http->POST(postBody.c_str());
-        if (httpCode != 200) {
-            Serial.printf("Got bad status code from sonos play operation %d\n", httpCode);
-            Serial.printf("BODY: %s\n", http->getString().c_str());
-            return httpCode;
-        } else {
-            return 0;
+int sonosOperation(SonosOperation operation, IPAddress targetSonos, int amount, int *result) {
+    MemoryScope memory(memoryOp(operation));
+    EnergyScope radio(ENERGY_HTTP);
+    *result = -1;
+    unsent = false;
+    traceMark(TRACE_OPERATION_START);
+    int errorCode = operation(targetSonos, amount, result);
+    traceMark(TRACE_OPERATION_DONE);
+    if (errorCode) {
+        // Don't trust a socket that just failed us for the next operation
+        sonosConnection(targetSonos)->close();
+        IPAddress coordinator = sonosTopologyCoordinator(targetSonos);
+        if (coordinator != targetSonos) {
+            sonosConnection(coordinator)->close();
         }
-    } else {
-        Serial.println("Couldn't connect to sonos, maybe need to re-discover");
-        return ENO_CANTCONNECT;
+        Serial.printf("Got error from sonos operation %d\n", errorCode);
+    }
+    return errorCode;
+}
+
+boolean sonosOperationUnsent() {
+    return unsent;
+}
+
+// Ask the player for its transport state, state is left empty if we couldn't get it
+void playState(IPAddress targetSonos, char *state, size_t len) {
+    SonosConnection *conn;
+    int httpCode = postTransport(targetSonos, GET_TRANSPORT_INFO, &conn);
+    state[0] = '\0';
+    if (httpCode == 200) {
+        /* We're going to get back a soap response like this:
+            <?xml version="1.0"?>
+            <s:Envelope xmlns:s="http://schemas.xmlsoap.org/soap/envelope/" s:encodingStyle="http://schemas.xmlsoap.org/soap/encoding/">
+              <s:Body>
+                <u:GetTransportInfoResponse xmlns:u="urn:schemas-upnp-org:service:AVTransport:1">
+                  <CurrentTransportState>PLAYING</CurrentTransportState>
+                  <CurrentTransportStatus>OK</CurrentTransportStatus>
+                  <CurrentSpeed>1</CurrentSpeed>
+                </u:GetTransportInfoResponse>
+              </s:Body>
+            </s:Envelope>
+         */
+        xmlTagValue(conn, "CurrentTransportState", state, len);
+    } else if (httpCode > 0) {
+        Serial.printf("Got http error code %d\n", httpCode);
+        printBody(conn);
     }
+    conn->finish();
 }
 
-int sonosNext(HTTPClient *http, IPAddress targetSonos) {
-    auto postBody = soapCall("Next");
+int sonosPlay(IPAddress targetSonos, int presses, int *result) {
+    if (presses % 2 == 0) {
+        Serial.printf("Got %d play presses, they cancel out\n", presses);
+        return 0;
+    }
 
-    if (http->begin(targetSonos.toString(), SONOS_PORT, "/MediaRenderer/AVTransport/Control")) {
-        Serial.printf("POST: BODY %s\n", postBody.c_str());
-        http->addHeader("Content-Type", "text/xml; charset=\"utf-8\"");
-        http->addHeader("SOAPACTION", "urn:schemas-upnp-org:service:AVTransport:1#Next");
+    // Only ask the player when we don't have an up to date state from its events
+    char currentState[24];
+    const char *shadowState = sonosShadowTransportState(targetSonos);
+    if (shadowState != NULL) {
+        strncpy(currentState, shadowState, sizeof(currentState) - 1);
+        currentState[sizeof(currentState) - 1] = '\0';
+    } else {
+        playState(targetSonos, currentState, sizeof(currentState));
+    }
+    Serial.printf("Current play state is %s\n", currentState);
+
+    boolean pause = strcmp(currentState, "PLAYING") == 0;
+    const SoapAction &action = pause ? PAUSE : PLAY;
+    Serial.printf("POST: %s\n", action.soapAction);
+
+    SonosConnection *conn;
+    int httpCode = postTransport(targetSonos, action, &conn);
+    if (httpCode < 0) {
+        return requestFailed(conn, httpCode);
+    } else if (httpCode != 200) {
+        Serial.printf("Got bad status code from sonos play operation %d\n", httpCode);
+        printBody(conn);
+        conn->finish();
+        return httpCode;
+    }
+    conn->finish();
+    sonosShadowTransportChanged(targetSonos, pause ? "PAUSED_PLAYBACK" : "PLAYING");
+    *result = pause ? 0 : 1;
+    return 0;
+}
 
-        int httpCode = http->POST(postBody.c_str());
-        if (httpCode != 200) {
-            Serial.printf("Got bad status code from sonos next operation %d\n", httpCode);
-            Serial.printf("BODY: %s\n", http->getString().c_str());
+// Send a transport action times times in a row
+static int repeatTransport(IPAddress targetSonos, const SoapAction &action, int times) {
+    Serial.printf("POST: %s x%d\n", action.soapAction, times);
+
+    // There's no way to skip more than one track without looking up where we are, but these all share one connection
+    for (int i = 0; i < times; i++) {
+        SonosConnection *conn;
+        int httpCode = postTransport(targetSonos, action, &conn);
+        if (httpCode < 0) {
+            return requestFailed(conn, httpCode);
+        } else if (httpCode != 200) {
+            Serial.printf("Got bad status code from sonos %s %d\n", action.soapAction, httpCode);
+            printBody(conn);
+            conn->finish();
             return httpCode;
-        } else {
-            return 0;
         }
-    } else {
-        Serial.println("Couldn't connect to sonos, maybe need to re-discover");
-        return ENO_CANTCONNECT;
+        conn->finish();
     }
+    return 0;
+}
 
+int sonosNext(IPAddress targetSonos, int tracks, int *result) {
+    return repeatTransport(targetSonos, NEXT, tracks);
 }
 
-int getVolume(HTTPClient *http, IPAddress targetSonos) {
-    if (http->begin(targetSonos.toString(), SONOS_PORT, "/MediaRenderer/RenderingControl/Control")) {
-        http->addHeader("Content-Type", "text/xml; charset=\"utf-8\"");
-        http->addHeader("SOAPACTION", "urn:schemas-upnp-org:service:RenderingControl:1#GetVolume");
+int sonosPrevious(IPAddress targetSonos, int tracks, int *result) {
+    return repeatTransport(targetSonos, PREVIOUS, tracks);
+}
 
-        int httpCode = http->POST(GET_VOLUME_CALL.c_str());
-        if (httpCode != 200) {
-            Serial.printf("Got bad status code from sonos next operation %d\n", httpCode);
-            Serial.printf("BODY: %s\n", http->getString().c_str());
-            return -1;
-        } else {
-            auto volStr = tagValue(std::string(http->getString().c_str()), "CurrentVolume");
-            return String(volStr.c_str()).toInt();
-        }
+int changeVolume(IPAddress targetSonos, int amount, int *result) {
+    if (amount == 0) {
+        return 0;
+    }
+    // The player applies the change, clamps it and tells us where it ended up, all in one round trip
+    Serial.printf("POST: %s %d\n", SET_RELATIVE_VOLUME.soapAction, amount);
+
+    SonosConnection *conn = sonosConnection(targetSonos);
+    int httpCode = conn->post(SET_RELATIVE_VOLUME, amount);
+    if (httpCode < 0) {
+        return requestFailed(conn, httpCode);
+    } else if (httpCode != 200) {
+        Serial.printf("Got bad status code from sonos set relative volume operation %d\n", httpCode);
+        printBody(conn);
+        conn->finish();
+        return httpCode;
+    }
+    /* We get back the volume it's at now:
+        <u:SetRelativeVolumeResponse xmlns:u="urn:schemas-upnp-org:service:RenderingControl:1">
+          <NewVolume>37</NewVolume>
+        </u:SetRelativeVolumeResponse>
+     */
+    char volStr[8];
+    if (xmlTagValue(conn, "NewVolume", volStr, sizeof(volStr)) > 0) {
+        *result = atoi(volStr);
+        sonosShadowVolumeChanged(targetSonos, *result);
+    }
+    conn->finish();
+    return 0;
+}
 
-    } else {
-        Serial.println("Couldn't connect to sonos, maybe need to re-discover");
-        return -1;
+// The connection the ramp is streaming down, NULL when we're not ramping
+static SonosConnection *rampConn = NULL;
+
+// Read the oldest reply in the ramp's pipeline, putting the volume it reports in volume
+static int rampResponse(int *volume) {
+    int httpCode = rampConn->response();
+    if (httpCode < 0) {
+        return httpCode == SONOS_ERROR_TIMEOUT ? ENO_TIMEOUT : ENO_CANTCONNECT;
+    } else if (httpCode != 200) {
+        Serial.printf("Got bad status code from sonos volume ramp %d\n", httpCode);
+        rampConn->finish();
+        return httpCode;
+    }
+    char volStr[8];
+    if (xmlTagValue(rampConn, "NewVolume", volStr, sizeof(volStr)) > 0) {
+        *volume = atoi(volStr);
+        sonosShadowVolumeChanged(rampConn->address(), *volume);
     }
+    rampConn->finish();
+    return 0;
 }
 
-int changeVolume(HTTPClient *http, IPAddress targetSonos, int amount) {
-    int currentVolume = getVolume(http, targetSonos);
-    if (currentVolume < 0) {
-        Serial.println("Couldn't get the current volume");
+int sonosRampVolume(IPAddress targetSonos, int adjustment, int *volume) {
+    MemoryScope memory(MEM_OP_RAMP);
+    EnergyScope radio(ENERGY_HTTP);
+    rampConn = sonosConnection(targetSonos);
+    // Only wait for a reply once there are enough requests queued up ahead of it to cover the round trip
+    int error = 0;
+    if (rampConn->pipelined() >= VOLUME_RAMP_DEPTH) {
+        error = rampResponse(volume);
+    }
+    if (error == ENO_CANTCONNECT) {
+        return error;
+    }
+    if (rampConn->pipeline(SET_RELATIVE_VOLUME, adjustment) < 0) {
+        Serial.println("Couldn't send volume ramp step");
         return ENO_CANTCONNECT;
     }
+    return error;
+}
 
-    int nextVolume = currentVolume + amount;
-    if (nextVolume < 0) {
-        nextVolume = 0;
-    } else if (nextVolume > 100) {
-        nextVolume = 100;
+int sonosRampEnd(int *volume) {
+    MemoryScope memory(MEM_OP_RAMP, rampConn != NULL && rampConn->pipelined() > 1 ? rampConn->pipelined() : 1);
+    EnergyScope radio(ENERGY_HTTP);
+    int error = 0;
+    while (rampConn != NULL && rampConn->pipelined() > 0 && error != ENO_CANTCONNECT) {
+        error = rampResponse(volume);
     }
+    rampConn = NULL;
+    return error;
+}
 
-    if (http->begin(targetSonos.toString(), SONOS_PORT, "/MediaRenderer/RenderingControl/Control")) {
-        auto call = changeVolumeCall(nextVolume);
-        Serial.printf("POST: BODY %s\n", call.c_str());
-        http->addHeader("Content-Type", "text/xml; charset=\"utf-8\"");
-        http->addHeader("SOAPACTION", "urn:schemas-upnp-org:service:RenderingControl:1#SetVolume");
+static const SoapAction &commandAction(SonosCommand command) {
+    switch (command) {
+        case SONOS_PAUSE:
+            return PAUSE;
+        case SONOS_RESUME:
+            return PLAY;
+        case SONOS_NEXT:
+            return NEXT;
+        default:
+            return PREVIOUS;
+    }
+}
 
-        int httpCode = http->POST(call.c_str());
-        if (httpCode != 200) {
-            Serial.printf("Got bad status code from sonos next operation %d\n", httpCode);
-            Serial.printf("BODY: %s\n", http->getString().c_str());
-            return httpCode;
-        } else {
-            return 0;
+// Put command's requests on the wire to one player without waiting for any answers
+static int fanSend(SonosConnection *conn, SonosCommand command, int amount) {
+    if (command == SONOS_VOLUME) {
+        return conn->pipeline(SET_RELATIVE_VOLUME, amount);
+    }
+    int times = command == SONOS_NEXT || command == SONOS_PREVIOUS ? amount : 1;
+    for (int i = 0; i < times; i++) {
+        int error = conn->pipeline(commandAction(command));
+        if (error < 0) {
+            return error;
         }
-
-    } else {
-        Serial.println("Couldn't connect to sonos, maybe need to re-discover");
-        return -1;
     }
+    return 0;
 }
 
-int volumeUp(HTTPClient *http, IPAddress targetSonos) {
-    return changeVolume(http, targetSonos, 7);
+// Read every answer fanSend asked one player for
+static void fanReceive(SonosConnection *conn, SonosCommand command, SonosFanResult *result) {
+    uint8_t expected = conn->pipelined();
+    for (uint8_t i = 0; i < expected; i++) {
+        // A response without keep-alive closes the socket and everything behind it
+        int httpCode = conn->pipelined() > 0 ? conn->response() : SONOS_ERROR_READ;
+        if (httpCode < 0) {
+            result->error = httpCode == SONOS_ERROR_TIMEOUT ? ENO_TIMEOUT : ENO_CANTCONNECT;
+            return;
+        } else if (httpCode != 200) {
+            Serial.printf("Got bad status code %d from %s\n", httpCode, conn->address().toString().c_str());
+            result->error = httpCode;
+        } else if (command == SONOS_VOLUME) {
+            char volStr[8];
+            if (xmlTagValue(conn, "NewVolume", volStr, sizeof(volStr)) > 0) {
+                result->result = atoi(volStr);
+                sonosShadowVolumeChanged(conn->address(), result->result);
+            }
+        }
+        conn->finish();
+    }
 }
 
-int volumeDown(HTTPClient *http, IPAddress targetSonos) {
-    return changeVolume(http, targetSonos, -7);
-}
+int sonosFanOut(SonosCommand command, int amount, const IPAddress *targets, uint8_t count, SonosFanResult *results) {
+    traceMark(TRACE_OPERATION_START);
+    boolean transport = command != SONOS_VOLUME;
+    if (count > SONOS_FANOUT_MAX) {
+        count = SONOS_FANOUT_MAX;
+    }
+    MemoryScope memory(MEM_OP_FANOUT, count);
+    EnergyScope radio(ENERGY_HTTP);
+
+    // Where each target's requests go, the players in a group share their coordinator's
+    SonosFanResult endpoints[SONOS_FANOUT_MAX];
+    uint8_t endpointOf[SONOS_FANOUT_MAX];
+    uint8_t endpointCount = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        IPAddress endpoint = transport ? sonosTopologyCoordinator(targets[i]) : targets[i];
+        uint8_t j = 0;
+        while (j < endpointCount && endpoints[j].target != endpoint) {
+            j++;
+        }
+        if (j == endpointCount) {
+            endpoints[j] = { endpoint, 0, -1, 0 };
+            endpointCount++;
+        }
+        endpointOf[i] = j;
+    }
+
+    // Every request in a batch goes out before we wait on any of them, so the players all work on them at once.
+    // Batches are as big as the pool so nobody's socket gets taken over with answers still waiting on it
+    for (uint8_t first = 0; first < endpointCount; first += SONOS_POOL_SIZE) {
+        uint8_t last = first + SONOS_POOL_SIZE < endpointCount ? first + SONOS_POOL_SIZE : endpointCount;
+        unsigned long start = millis();
+        // Cold sockets all start connecting before we wait on any of them
+        for (uint8_t j = first; j < last; j++) {
+            sonosConnection(endpoints[j].target)->prepare();
+        }
+        for (uint8_t j = first; j < last; j++) {
+            if (fanSend(sonosConnection(endpoints[j].target), command, amount) < 0) {
+                Serial.printf("Couldn't send to %s\n", endpoints[j].target.toString().c_str());
+                endpoints[j].error = ENO_CANTCONNECT;
+            }
+        }
+        for (uint8_t j = first; j < last; j++) {
+            fanReceive(sonosConnection(endpoints[j].target), command, &endpoints[j]);
+            endpoints[j].ms = millis() - start;
+        }
+    }
 
+    // A coordinator that turned a transport command down means our idea of its group is stale, so send
+    // those the slow way, which checks with one of the group's players and follows it to its real coordinator
+    for (uint8_t j = 0; j < endpointCount && transport; j++) {
+        if (endpoints[j].error != 500) {
+            continue;
+        }
+        uint8_t i = 0;
+        while (endpointOf[i] != j) {
+            i++;
+        }
+        unsigned long start = millis();
+        endpoints[j].error = repeatTransport(targets[i], commandAction(command), command == SONOS_PAUSE || command == SONOS_RESUME ? 1 : amount);
+        endpoints[j].ms += millis() - start;
+    }
+
+    int failed = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        SonosFanResult *result = &results[i];
+        *result = endpoints[endpointOf[i]];
+        result->target = targets[i];
+        if (result->error == 0 && (command == SONOS_PAUSE || command == SONOS_RESUME)) {
+            result->result = command == SONOS_RESUME ? 1 : 0;
+            sonosShadowTransportChanged(targets[i], result->result ? "PLAYING" : "PAUSED_PLAYBACK");
+        }
+        if (result->error != 0) {
+            failed++;
+        }
+    }
+    traceMark(TRACE_OPERATION_DONE);
+    return failed;
+}
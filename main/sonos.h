@@ -1,16 +1,82 @@
+#pragma once
+
 #include <Arduino.h>
-#include <HTTPClient.h>
 
 #define HTTP_TIMEOUT 2000
 #define SONOS_PORT 1400
 
-#define ENO_CANTCONNECT 11;
+// Operations return this when the player couldn't be reached at all, other errors are http status codes
+#define ENO_CANTCONNECT 11
+// A newer press cancelled the operation before its command got to the player, see sonosCancel()
+#define ENO_CANCELLED 12
+// The player took the command but didn't answer in time. It's still there and may well carry it out, so it
+// isn't a reason to go looking for it
+#define ENO_TIMEOUT 13
+
+// How many times we send the SSDP search before giving up
+#define SSDP_ATTEMPTS 4
+// How long we wait for an answer to the first search, doubling for each one after that
+#define SSDP_FIRST_WAIT_MS 100
+
+// How much one press of a volume button changes the volume
+#define VOLUME_STEP 7
+// While a volume button is held, send a step this big every VOLUME_RAMP_INTERVAL_MS, so 0-100 takes about 5 seconds
+#define VOLUME_RAMP_STEP 2
+#define VOLUME_RAMP_INTERVAL_MS 100
+// How many ramp requests can be waiting on replies before we stop to read one
+#define VOLUME_RAMP_DEPTH 2
+
+// Operations take an amount so that a burst of presses can be sent as one command, and put what the
+// player told us about its new state in result (-1 if it didn't say)
+typedef int (*SonosOperation)(IPAddress target, int amount, int *result);
+
+int sonosOperation(SonosOperation operation, IPAddress targetSonos, int amount, int *result);
+// Whether the last operation failed with ENO_CANTCONNECT before its request went out, so sending it again somewhere
+// else can't carry it out twice
+boolean sonosOperationUnsent();
+
+// Toggle play/pause once for every press, an even number of presses cancels out. result is 1 if it's now playing, 0 if paused
+int sonosPlay(IPAddress targetSonos, int presses, int *result);
+// Skip ahead the given number of tracks
+int sonosNext(IPAddress targetSonos, int tracks, int *result);
+// Go back the given number of tracks
+int sonosPrevious(IPAddress targetSonos, int tracks, int *result);
+// Change the volume by amount, the player clamps it to 0-100. result is the volume it ended up at
+int changeVolume(IPAddress targetSonos, int amount, int *result);
+
+// Stream one step of a volume ramp down the player's connection without waiting for the step to be answered.
+// volume gets the latest level the player has reported back, if any replies have been read
+int sonosRampVolume(IPAddress targetSonos, int adjustment, int *volume);
+// Read the replies to the rest of the ramp's steps
+int sonosRampEnd(int *volume);
+
+// Most targets one fan-out takes, a whole household's worth
+#define SONOS_FANOUT_MAX 16
+
+// Commands that can go out to several players at once
+typedef enum {
+    SONOS_PAUSE,
+    SONOS_RESUME,
+    // Skip amount tracks
+    SONOS_NEXT,
+    SONOS_PREVIOUS,
+    // Change the volume by amount
+    SONOS_VOLUME
+} SonosCommand;
 
-int sonosOperation(int (*operation)(HTTPClient *http, IPAddress target), IPAddress targetSonos);
+typedef struct {
+    IPAddress target;
+    // 0, ENO_CANTCONNECT or an http status code, like an operation returns
+    int error;
+    // What the player told us about its new state like an operation's result, the volume for SONOS_VOLUME
+    int result;
+    // How long after the requests went out the player was done answering
+    unsigned long ms;
+} SonosFanResult;
 
-int volumeUp(HTTPClient *http, IPAddress targetSonos);
-int volumeDown(HTTPClient *http, IPAddress targetSonos);
-int sonosNext(HTTPClient *http, IPAddress targetSonos);
-int sonosPlay(HTTPClient *http, IPAddress targetSonos);
+// Send command to every one of targets at once, so it takes about as long as the slowest player rather than all
+// of them added up. Transport commands go to each group's coordinator once however many of its members are in
+// targets. results gets an entry for each target, returns how many of them failed
+int sonosFanOut(SonosCommand command, int amount, const IPAddress *targets, uint8_t count, SonosFanResult *results);
 
 IPAddress discoverSonos(std::string uid);
@@ -13,8 +13,30 @@
 #include <esp_wifi.h>
 #include <driver/touch_pad.h>
 #include <driver/rtc_io.h>
+#include <driver/gpio.h>
+#include <esp_pm.h>
+#include <tcpip_adapter.h>
+#include <lwip/dhcp.h>
+#include <lwip/etharp.h>
+#include <lwip/priv/tcpip_priv.h>
+#include <time.h>
+#include <esp_clk.h>
+#include <soc/rtc.h>
+#include <soc/rtc_cntl_reg.h>
 #include "ulp_main.h"
+#include "ulp/ulp_press_ring.h"
 #include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_events.h"
+#include "press_queue.h"
+#include "sonos_topology.h"
+#include "sonos_trace.h"
+#include "sonos_memory.h"
+#include "sonos_rtt.h"
+#include "sonos_target.h"
+#include "leds.h"
+#include "sleep_policy.h"
+#include "energy.h"
 #include <esp32/ulp.h>
 #include "config.h"
 
@@ -25,12 +47,49 @@
 #define NUM_BTN_COLUMNS (4)
 #define NUM_BTN_ROWS (1)
 #define NUM_LED_COLUMNS (4)
+// The LEDs only get multiplexed across columns, by the LEDC peripheral, so there can only be one row
 #define NUM_LED_ROWS (1)
+#define ALL_LEDS ((1 << NUM_LED_COLUMNS) - 1)
+static_assert(NUM_LED_COLUMNS == LED_COUNT, "leds.h needs a channel for every LED column");
 
 #define MAX_DEBOUNCE (3)
 
-// This is roughly 30 seconds with the various delays + scanning time
-#define IDLE_LOOPS_SLEEPY 4500
+// How often the ULP scans the buttons while we're booting after it woke us, sleep_policy.h picks it for deep sleep
+#define ULP_AWAKE_PERIOD_US 20000
+// Most we wait for the ULP to finish a pass before taking the buttons anyway, a period plus a slow pass where
+// every debounce step starts it over
+#define ULP_PASS_WAIT_MS 100
+
+// Gesture timings. A ramping button held this long starts ramping
+#define HOLD_MS 400
+// Any other button held this long before letting go is a long press
+#define LONG_PRESS_MS 800
+// A second tap this soon after the first is a double tap, keep it under COALESCE_WINDOW_MS so the first tap is still pending
+#define DOUBLE_TAP_MS 250
+
+// While any button is down the matrix gets scanned this often, so a press is picked up MAX_DEBOUNCE
+// scans after the interrupt and a release MAX_DEBOUNCE scans after it happens. Otherwise we wait on
+// the row interrupt with the CPU in light sleep
+#define SCAN_PERIOD_MS 5
+// How long a column gets to settle after it's pulled low before reading the rows
+#define SCAN_SETTLE_US 50
+
+// Used when lwip can't tell us how long our DHCP lease is
+#define WIFI_LEASE_DEFAULT_SECONDS 3600
+// Renew the lease once this fraction of it has gone by, like the DHCP T1 timer
+#define WIFI_LEASE_RENEW_PERCENT 50
+// How long we give DHCP to renew the lease before going to sleep
+#define WIFI_LEASE_RENEW_TIMEOUT 5000
+
+// Presses of the same kind that land within this long of each other get sent as one command
+#define COALESCE_WINDOW_MS 300
+
+// How often the command task wakes up to look after the event subscriptions when nothing is going on
+#define COMMAND_IDLE_WAIT_MS 50
+// The command task runs on the other core from the button scanner and LEDs, alongside the wifi stack
+#define COMMAND_TASK_CORE 0
+// How long the LEDs show the volume the player reports after a volume change
+#define VOLUME_DISPLAY_MS 1500
 
 static const gpio_num_t btncolumnpins[NUM_BTN_COLUMNS] = {GPIO_NUM_12, GPIO_NUM_14, GPIO_NUM_27, GPIO_NUM_26};
 static const gpio_num_t btnrowpins[NUM_BTN_ROWS]       = {GPIO_NUM_33};
@@ -42,30 +101,144 @@ extern const uint8_t bin_start[] asm("_binary_ulp_main_bin_start");
 extern const uint8_t bin_end[]   asm("_binary_ulp_main_bin_end");
 
 static int8_t debounce_count[NUM_BTN_COLUMNS][NUM_BTN_ROWS];
+// Gesture state for each button, only touched by the scanner
+static unsigned long pressed_at[NUM_BTN_COLUMNS][NUM_BTN_ROWS];
+static unsigned long last_tap_at[NUM_BTN_COLUMNS][NUM_BTN_ROWS];
+static boolean holding[NUM_BTN_COLUMNS][NUM_BTN_ROWS];
+// Still down from when the ULP was scanning, which already recorded the press
+static boolean held_from_ulp[NUM_BTN_COLUMNS][NUM_BTN_ROWS];
 static const char* TAG = "SonosButtons";
 
-// bit field representing the buttons activated on the last scan loop
-static uint8_t buttons_released = 0;
-// bit field representing the buttons activated that caused us to wakeup
-uint8_t sleep_buttons = 0;
+static TaskHandle_t commandTask = NULL;
+// The loop task, which scans the buttons, woken by the row interrupt
+static TaskHandle_t scannerTask = NULL;
+void commandLoop(void *args);
+// Set by the command task while it has presses it hasn't sent yet
+static volatile boolean commandBusy = false;
+// The scanner asks the command task to shut the network down, and it answers once it has
+static volatile boolean napRequested = false;
+static volatile boolean networkDown = false;
+// The scanner asks the command task to doze once the awake window is up, and clears it on the next press
+static volatile boolean dozeRequested = false;
+
+typedef struct ButtonAction {
+    const char *name;
+    SonosOperation operation;
+    // How much each press adds to the amount the operation gets called with
+    int step;
+    // What a long press or double tap does instead, NULL if it's just a press (or two)
+    const struct ButtonAction *longPress;
+    const struct ButtonAction *doubleTap;
+    // Holding the button streams a volume ramp in the direction of step
+    boolean ramps;
+    // UIDs of the players to fan command out to instead of calling operation on SONOS_UID, ending in NULL.
+    // Leave it NULL for just SONOS_UID, or use EVERY_GROUP for every group in the house
+    const char *const *targets;
+    SonosCommand command;
+} ButtonAction;
+
+static const char *const EVERY_GROUP[] = { NULL };
+
+static const ButtonAction previousAction = { "previous", sonosPrevious, 1, NULL, NULL, false };
+static const ButtonAction housePauseAction = { "pause everywhere", NULL, 1, NULL, NULL, false, EVERY_GROUP, SONOS_PAUSE };
+
+// Indexed by button number, volume up and down share an operation so a mixed burst nets out
+static const ButtonAction buttonActions[NUM_BTN_COLUMNS * NUM_BTN_ROWS] = {
+    // Double tap skips like headphone remotes do, long press goes back a track
+    { "play/pause", sonosPlay, 1, &previousAction, &buttonActions[1], false },
+    // Long press pauses the whole house
+    { "next", sonosNext, 1, &housePauseAction, NULL, false },
+    { "volume up", changeVolume, VOLUME_STEP, NULL, NULL, true },
+    { "volume down", changeVolume, -VOLUME_STEP, NULL, NULL, true }
+};
+
+// The burst of presses waiting to be sent
+static struct {
+    const ButtonAction *action;
+    int amount;
+    uint8_t presses;
+    // bit field of the buttons in the burst, so we can turn their LEDs off when it's done
+    uint8_t buttons;
+    unsigned long lastPress;
+} pending = { NULL, 0, 0, 0, 0 };
+
+// The volume ramp streaming while a volume button is held
+static struct {
+    // NULL when nothing is held
+    const ButtonAction *action;
+    uint8_t button;
+    unsigned long nextStep;
+    // The last volume the player reported, -1 until one comes back
+    int volume;
+} ramp = { NULL, 0, 0, -1 };
+
+// The burst the command task is sending right now if a newer press of the same command can cancel it, otherwise NULL
+static const ButtonAction *volatile sending = NULL;
+
+// Whether presses of a and b do the same thing to the same players, so they can go out as one burst
+static boolean sameCommand(const ButtonAction *a, const ButtonAction *b) {
+    return a->operation == b->operation && a->targets == b->targets && a->command == b->command;
+}
 
-static uint8_t LEDS_lit = 0;
-static IPAddress targetSonos;
+// Whether a burst of action can be stopped part way and sent again with more presses added. Play presses
+// can cancel each other out and volume steps add up, but a skip that's been half sent can't be taken back
+static boolean cancellable(const ButtonAction *action) {
+    return action->targets == NULL && (action->operation == sonosPlay || action->operation == changeVolume);
+}
+
+// What a gesture on button does, NULL for the holds which ramp instead
+static const ButtonAction *gestureAction(uint8_t button, Gesture gesture) {
+    const ButtonAction *action = &buttonActions[button];
+    switch (gesture) {
+        case GESTURE_DOUBLE_TAP:
+            // Without a double tap action it's just the second of two taps
+            return action->doubleTap != NULL ? action->doubleTap : action;
+        case GESTURE_LONG_PRESS:
+            return action->longPress != NULL ? action->longPress : action;
+        case GESTURE_HOLD_START:
+        case GESTURE_HOLD_END:
+            return NULL;
+        default:
+            return action;
+    }
+}
 
 // Store the base station mac address and channel in RTC memory so we can re-connect more quickly
 static RTC_DATA_ATTR struct {
     uint8_t bssid [6];
     uint16_t channel; // Make this 16 bites to align on the 32 bit boundary
+    // Our last DHCP lease so we can skip DHCP on the way up, ip is 0 if we don't have one
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gateway;
+    uint32_t dns;
+    // time() when the lease was handed out, the RTC clock keeps counting through deep sleep
+    uint32_t leaseStart;
+    uint32_t leaseSeconds;
+    uint8_t gatewayMac[6];
+    uint16_t padding; // Keep the struct a multiple of 32 bits for the checksum
 } wifi_cache;
 
+// Whether we came up on the cached lease rather than asking DHCP this time
+static boolean usingCachedLease = false;
+
 static RTC_DATA_ATTR uint32_t wifi_cache_checksum;
 
+// Stop using the cached lease, we'll go back to DHCP before we sleep
+void forgetWifiLease() {
+    wifi_cache.ip = 0;
+    wifi_cache.leaseStart = 0;
+    wifi_cache.leaseSeconds = 0;
+    memset(wifi_cache.gatewayMac, 0, sizeof(wifi_cache.gatewayMac));
+}
+
 void clearWifiCache() {
     wifi_cache_checksum = 1;
     for (uint32_t i = 0; i < sizeof(wifi_cache.bssid); i++) {
         wifi_cache.bssid[i] = 0xFF;
     }
     wifi_cache.channel = 0;
+    forgetWifiLease();
 }
 
 bool checkWifiCache() {
@@ -98,6 +271,100 @@ bool checkWifiCache() {
     }
 }
 
+typedef struct {
+    struct tcpip_api_call_data call;
+    ip4_addr_t gateway;
+    uint8_t gatewayMac[6];
+    boolean gatewayKnown;
+    // 0 unless DHCP gave us our address
+    uint32_t leaseSeconds;
+} LeaseQuery;
+
+// Runs on the lwip thread, the only place it's safe to look at the ARP table and DHCP state
+static err_t queryLease(struct tcpip_api_call_data *call) {
+    LeaseQuery *query = (LeaseQuery *) call;
+    struct netif *netif;
+    if (tcpip_adapter_get_netif(TCPIP_ADAPTER_IF_STA, (void **) &netif) != ESP_OK || netif == NULL) {
+        return ERR_IF;
+    }
+
+    struct eth_addr *mac;
+    const ip4_addr_t *ip;
+    if (etharp_find_addr(netif, &query->gateway, &mac, &ip) >= 0) {
+        memcpy(query->gatewayMac, mac->addr, sizeof(query->gatewayMac));
+        query->gatewayKnown = true;
+    } else {
+        // Nothing has needed the gateway yet, ask for it so it's there next time we look
+        etharp_request(netif, &query->gateway);
+    }
+
+    struct dhcp *dhcp = netif_dhcp_data(netif);
+    if (dhcp != NULL && dhcp_supplied_address(netif)) {
+        query->leaseSeconds = dhcp->offered_t0_lease > 0 ? dhcp->offered_t0_lease : WIFI_LEASE_DEFAULT_SECONDS;
+    }
+    return ERR_OK;
+}
+
+static void runLeaseQuery(LeaseQuery *query) {
+    memset(query, 0, sizeof(*query));
+    query->gateway.addr = (uint32_t) WiFi.gatewayIP();
+    tcpip_api_call(queryLease, &query->call);
+}
+
+// Remember the lease DHCP just gave us
+static void storeWifiLease(const LeaseQuery &query) {
+    wifi_cache.ip = WiFi.localIP();
+    wifi_cache.netmask = WiFi.subnetMask();
+    wifi_cache.gateway = WiFi.gatewayIP();
+    wifi_cache.dns = WiFi.dnsIP();
+    wifi_cache.leaseStart = time(NULL);
+    wifi_cache.leaseSeconds = query.leaseSeconds;
+    memset(wifi_cache.gatewayMac, 0, sizeof(wifi_cache.gatewayMac));
+    ESP_LOGD(TAG, "Got a %d second lease for %s", query.leaseSeconds, WiFi.localIP().toString().c_str());
+}
+
+static boolean wifiLeaseUsable() {
+    uint32_t age = time(NULL) - wifi_cache.leaseStart;
+    return wifi_cache.ip != 0 && age < wifi_cache.leaseSeconds * WIFI_LEASE_RENEW_PERCENT / 100;
+}
+
+// Called on the way down, when nothing is waiting on the network: check the cached lease still
+// holds up and renew it if it's getting old, so the next wake up can skip DHCP again
+static void checkWifiLease() {
+    LeaseQuery query;
+    runLeaseQuery(&query);
+    if (usingCachedLease && query.gatewayKnown) {
+        boolean haveMac = false;
+        for (uint8_t i = 0; i < sizeof(wifi_cache.gatewayMac); i++) {
+            haveMac |= wifi_cache.gatewayMac[i] != 0;
+        }
+        if (haveMac && memcmp(query.gatewayMac, wifi_cache.gatewayMac, sizeof(query.gatewayMac)) != 0) {
+            // Some other box answers for the gateway, so this isn't the network the lease came from
+            ESP_LOGW(TAG, "Gateway MAC changed, dropping cached lease");
+            forgetWifiLease();
+        }
+    }
+
+    if (!wifiLeaseUsable()) {
+        ESP_LOGI(TAG, "Renewing DHCP lease");
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+        unsigned long start = millis();
+        do {
+            delay(50);
+            runLeaseQuery(&query);
+        } while (query.leaseSeconds == 0 && millis() - start < WIFI_LEASE_RENEW_TIMEOUT);
+        if (query.leaseSeconds == 0) {
+            ESP_LOGW(TAG, "DHCP didn't answer, no lease for next time");
+            forgetWifiLease();
+            return;
+        }
+        storeWifiLease(query);
+    }
+    if (query.gatewayKnown) {
+        memcpy(wifi_cache.gatewayMac, query.gatewayMac, sizeof(wifi_cache.gatewayMac));
+    }
+}
+
 void storeWifiCache() {
     uint8_t *bssid = WiFi.BSSID();
     memcpy(wifi_cache.bssid, bssid, sizeof(wifi_cache.bssid));
@@ -114,127 +381,229 @@ void storeWifiCache() {
 }
 
 
+// The button pins are left alone here when the ULP woke us, it keeps scanning them until setupButtonPins()
 static void setuppins() {
+    // The LEDC peripheral drives the LEDs from here on
+    ledsBegin(ledcolumnpins, colorpins, NUM_LED_ROWS);
+}
+
+// A row went low, so something's been pressed. Level interrupts keep firing while it's held, so
+// leave the interrupt off until the scanner has seen everything let go again
+static void buttonInterrupt(void *arg) {
+    BaseType_t woken = pdFALSE;
+    for (uint8_t i = 0; i < NUM_BTN_ROWS; i++) {
+        gpio_intr_disable(btnrowpins[i]);
+    }
+    if (scannerTask != NULL) {
+        vTaskNotifyGiveFromISR(scannerTask, &woken);
+    }
+    if (woken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+// Pull every column low so any press pulls its row low, and wait for that
+static void armButtonInterrupt() {
+    for (uint8_t i = 0; i < NUM_BTN_COLUMNS; i++) {
+        digitalWrite(btncolumnpins[i], LOW);
+    }
+    for (uint8_t i = 0; i < NUM_BTN_ROWS; i++) {
+        gpio_intr_enable(btnrowpins[i]);
+    }
+}
+
+static void setupButtonPins() {
     uint8_t i, j;
 
     // button columns
     for (i = 0; i < NUM_BTN_COLUMNS; i++) {
+        rtc_gpio_hold_dis(btncolumnpins[i]);
         rtc_gpio_deinit(btncolumnpins[i]);
         pinMode(btncolumnpins[i], OUTPUT);
         digitalWrite(btncolumnpins[i], HIGH);
     }
 
-    for (i = 0; i < NUM_LED_COLUMNS; i++) {
-        pinMode(ledcolumnpins[i], OUTPUT);
-        digitalWrite(ledcolumnpins[i], HIGH);
-    }
-
-    // button row input lines
+    // button row input lines, any press pulls its row low when all the columns are low so that's what wakes the scanner
+    gpio_install_isr_service(0);
     for (i = 0; i < NUM_BTN_ROWS; i++) {
+        rtc_gpio_hold_dis(btnrowpins[i]);
         rtc_gpio_deinit(btnrowpins[i]);
         pinMode(btnrowpins[i], INPUT_PULLUP);
+        gpio_set_intr_type(btnrowpins[i], GPIO_INTR_LOW_LEVEL);
+        gpio_isr_handler_add(btnrowpins[i], buttonInterrupt, NULL);
+        gpio_intr_disable(btnrowpins[i]);
+        // The same level brings us out of light sleep
+        gpio_wakeup_enable(btnrowpins[i], GPIO_INTR_LOW_LEVEL);
     }
-
-    // LED drive lines
-    for (i = 0; i < NUM_LED_ROWS; i++) {
-        pinMode(colorpins[i], OUTPUT);
-        digitalWrite(colorpins[i], LOW);
-    }
+    esp_sleep_enable_gpio_wakeup();
 
     // Initialize the debounce counter array
     for (i = 0; i < NUM_BTN_COLUMNS; i++) {
         for (j = 0; j < NUM_BTN_ROWS; j++)  {
             debounce_count[i][j] = 0;
+            holding[i][j] = false;
+        }
+    }
+}
+
+// Hand a button gesture that happened at millis() time at over to the command task
+static void queueGesture(uint8_t button, Gesture gesture, unsigned long at) {
+    PressEvent event = { button, gesture, at };
+    if (gesture != GESTURE_HOLD_END) {
+        sleepPolicyPress();
+        energyPress();
+    }
+    if (pressQueuePush(event)) {
+        // Turn on the LED while we're working, the command task turns it off when it's done
+        ledsOn(1 << button);
+        // A press of the command that's on its way to the player stops it, so the command task can send the
+        // two as one burst. Pushed first so the press is waiting when the cancelled burst comes back
+        const ButtonAction *action = gestureAction(button, gesture);
+        const ButtonAction *current = sending;
+        if (action != NULL && current != NULL && sameCommand(action, current)) {
+            sonosCancel();
         }
+        if (commandTask != NULL) {
+            xTaskNotifyGive(commandTask);
+        }
+    } else {
+        ESP_LOGW(TAG, "Press queue is full, dropping button %d", button);
     }
+}
 
-    pinMode(5, OUTPUT);
-    digitalWrite(5, LOW);
-    LEDS_lit = 0;
+// A short press of the button at column, row was let go at time at. It's a double tap if it came soon enough after the
+// last tap, otherwise a tap
+static void queueTap(uint8_t column, uint8_t row, unsigned long at) {
+    uint8_t button = (column * NUM_BTN_ROWS) + row;
+    if (last_tap_at[column][row] != 0 && at - last_tap_at[column][row] < DOUBLE_TAP_MS) {
+        // A third tap starts over rather than being another double
+        last_tap_at[column][row] = 0;
+        queueGesture(button, GESTURE_DOUBLE_TAP, at);
+    } else {
+        last_tap_at[column][row] = at;
+        queueGesture(button, GESTURE_TAP, at);
+    }
 }
 
 // Button detection, adapted from the sparkfun hookup guide at https://learn.sparkfun.com/tutorials/button-pad-hookup-guide
-static void scan() {
-    buttons_released = 0;
-    static uint8_t current = 0;
+// Scans every column once, returns true while any button is down or still settling
+static boolean scan() {
+    uint8_t current;
     uint8_t val;
     uint8_t j;
+    boolean active = false;
 
-    // Select current columns
-    digitalWrite(btncolumnpins[current], LOW);
-    // pause a moment
-    delay(1);
+    // The columns are all low while we wait on the interrupt
+    for (current = 0; current < NUM_BTN_COLUMNS; current++) {
+        digitalWrite(btncolumnpins[current], HIGH);
+    }
 
-    // Read the button inputs
-    for (j = 0; j < NUM_BTN_ROWS; j++) {
-        val = digitalRead(btnrowpins[j]);
+    for (current = 0; current < NUM_BTN_COLUMNS; current++) {
+        // Select current columns
+        digitalWrite(btncolumnpins[current], LOW);
+        // pause a moment
+        delayMicroseconds(SCAN_SETTLE_US);
 
-        if (val == LOW) {
-            // active low: val is low when btn is pressed
-            if (debounce_count[current][j] < MAX_DEBOUNCE) {
-                debounce_count[current][j]++;
-            }
-        }
-        else {
-            // otherwise, button is released
-            if (debounce_count[current][j] > 0) {
-                debounce_count[current][j]--;
+        // Read the button inputs
+        for (j = 0; j < NUM_BTN_ROWS; j++) {
+            val = digitalRead(btnrowpins[j]);
+            uint8_t button = (current * NUM_BTN_ROWS) + j;
+            unsigned long now = millis();
 
-                if (debounce_count[current][j] == 0 ) {
-                    uint8_t released = (current * NUM_BTN_ROWS) + j;
-                    bitSet(buttons_released, released);
-                    // Turn on the LED while we're working
-                    bitSet(LEDS_lit, released);
+            if (val == LOW) {
+                // active low: val is low when btn is pressed
+                if (debounce_count[current][j] == 0) {
+                    pressed_at[current][j] = now;
+                }
+                if (debounce_count[current][j] < MAX_DEBOUNCE) {
+                    debounce_count[current][j]++;
+                } else if (buttonActions[button].ramps && !holding[current][j] && !held_from_ulp[current][j] && now - pressed_at[current][j] >= HOLD_MS) {
+                    holding[current][j] = true;
+                    queueGesture(button, GESTURE_HOLD_START, now);
                 }
             }
-        }
-    }// for j = 0 to 3;
+            else {
+                // otherwise, button is released
+                if (debounce_count[current][j] > 0) {
+                    debounce_count[current][j]--;
 
-    delay(1);
-    digitalWrite(btncolumnpins[current], HIGH);
+                    if (debounce_count[current][j] == 0 ) {
+                        if (held_from_ulp[current][j]) {
+                            held_from_ulp[current][j] = false;
+                        } else if (holding[current][j]) {
+                            holding[current][j] = false;
+                            queueGesture(button, GESTURE_HOLD_END, now);
+                        } else if (now - pressed_at[current][j] >= LONG_PRESS_MS) {
+                            queueGesture(button, GESTURE_LONG_PRESS, now);
+                        } else {
+                            queueTap(current, j, now);
+                        }
+                    }
+                }
+            }
+            if (debounce_count[current][j] > 0) {
+                active = true;
+            }
+        }// for j = 0 to 3;
 
-    current++;
-    if (current >= NUM_BTN_COLUMNS) {
-        current = 0;
+        digitalWrite(btncolumnpins[current], HIGH);
     }
+    return active;
 }
 
-void ledLoop( void * args ) {
-  
-    uint8_t i;
-    static uint8_t current = 0;
+void blinkAll(uint8_t times, int waitTime) {
+    ledsSet(ALL_LEDS, { LED_BLINK, LED_BRIGHTNESS, (uint16_t) waitTime });
+    delay(times * 2 * waitTime);
+    ledsOff(ALL_LEDS);
+}
 
-    for ( ;; ) {
-        for (current = 0; current < NUM_BTN_COLUMNS; current++) {
-            delay(1);
-            // output LED row values
-            for (i = 0; i < NUM_LED_ROWS; i++) {
-                digitalWrite(colorpins[i], LOW);
-                if (bitRead(LEDS_lit, (current * NUM_BTN_ROWS) + i)) {
-                    digitalWrite(ledcolumnpins[current], HIGH);
-                }
-            }
-        }
-        delay(10); 
-        for (current = 0; current < NUM_BTN_COLUMNS; current++) {
-            digitalWrite(ledcolumnpins[current], LOW);
-            for (i = 0; i < NUM_LED_ROWS; i++) {
-                digitalWrite(colorpins[i], HIGH);
-            }
-        }
-        if (LEDS_lit == 0) {
-            delay(25);
-        } 
+// Move the presses the ULP has recorded into the press queue, back dated to when they happened so
+// they coalesce and make double taps just like presses made while we're awake. The ULP doesn't time
+// how long a button is held, so they're all taps
+static void drainUlpPresses() {
+    uint16_t head = ulp_press_head & 0xFFFF;
+    uint16_t tail = ulp_press_tail & 0xFFFF;
+    uint16_t now = (rtc_time_get() >> ULP_STAMP_SHIFT) & 0xFFFF;
+    uint32_t *ring = &ulp_press_ring;
+    for (; tail != head; tail++) {
+        uint32_t *entry = ring + (tail & (ULP_PRESS_RING_SIZE - 1)) * 2;
+        uint8_t button = entry[0] & 0xFFFF;
+        uint16_t age = now - (entry[1] & 0xFFFF);
+        unsigned long ageMs = rtc_time_slowclk_to_us((uint64_t) age << ULP_STAMP_SHIFT, esp_clk_slowclk_cal_get()) / 1000;
+        ESP_LOGD(TAG, "ULP saw button %d %lums ago", button, ageMs);
+        // The command task picks these up as soon as it starts
+        queueTap(button / NUM_BTN_ROWS, button % NUM_BTN_ROWS, millis() - ageMs);
     }
+    // Hand the slots back only once we've read them
+    ulp_press_tail = tail;
 }
 
-void blinkAll(uint8_t times, int waitTime) {
-    uint8_t startVal = LEDS_lit;
-    for (uint8_t i = 0; i < times; i++) {
-       delay(waitTime);
-       LEDS_lit = 255;
-       delay(waitTime);
-       LEDS_lit = startVal;
+// Stop the ULP and start scanning the buttons ourselves
+static void takeButtonsFromUlp() {
+    // Wait for the end of a pass and stop the timer then, the next pass would only start a period later. A pass
+    // that's debouncing a press takes a lot longer than usual, so there's no telling how long one has left
+    ulp_scan_done = 0;
+    unsigned long start = millis();
+    while ((ulp_scan_done & 0xFFFF) == 0 && millis() - start < ULP_PASS_WAIT_MS) {
+        delay(1);
+    }
+    CLEAR_PERI_REG_MASK(RTC_CNTL_STATE0_REG, RTC_CNTL_ULP_CP_SLP_TIMER_EN);
+    if ((ulp_scan_done & 0xFFFF) == 0) {
+        ESP_LOGW(TAG, "ULP didn't finish a pass in %dms, taking the buttons anyway", ULP_PASS_WAIT_MS);
+    }
+    drainUlpPresses();
+    setupButtonPins();
+    // Don't count a press the ULP has already recorded a second time when it's let go
+    for (uint8_t i = 0; i < NUM_BTN_COLUMNS; i++) {
+        digitalWrite(btncolumnpins[i], LOW);
+        delay(1);
+        for (uint8_t j = 0; j < NUM_BTN_ROWS; j++) {
+            if (digitalRead(btnrowpins[j]) == LOW) {
+                debounce_count[i][j] = MAX_DEBOUNCE;
+                held_from_ulp[i][j] = true;
+            }
+        }
+        digitalWrite(btncolumnpins[i], HIGH);
     }
 }
 
@@ -245,22 +614,30 @@ boolean didJustWake() {
     boolean wokeUp = false;
     if (wakeup_reason == ESP_SLEEP_WAKEUP_ULP) {
         ESP_LOGI(TAG, "Woke up from sleep (ULP)");
-        sleep_buttons = ulp_wake_gpio_bit & 0xFF;
-        ESP_LOGD(TAG, "GPIO pressed was %d\n", ulp_wake_gpio_bit & 0xFF);
-        ulp_wake_gpio_bit = 0;
-        LEDS_lit = sleep_buttons;
+        // The ULP keeps scanning while we boot and join wifi, more often now there's someone waiting on it
+        ulp_set_wakeup_period(0, ULP_AWAKE_PERIOD_US);
+        drainUlpPresses();
         wokeUp = true;
     } else {
         ESP_LOGW(TAG, "Wakeup was not caused by deep sleep: %d\n",wakeup_reason); 
-        sleep_buttons = 0;
     }
 
     return wokeUp;
 }
 
 boolean connectWifi() {
+    traceMark(TRACE_WIFI_START);
+    energyPhase(ENERGY_WIFI_JOIN);
     WiFi.mode(WIFI_STA);
     bool wasCached = checkWifiCache();
+    usingCachedLease = wasCached && wifiLeaseUsable();
+    if (usingCachedLease) {
+        // Bring the interface straight up with the address we had last time instead of waiting on DHCP
+        ESP_LOGD(TAG, "Using cached lease for %s", IPAddress(wifi_cache.ip).toString().c_str());
+        WiFi.config(IPAddress(wifi_cache.ip), IPAddress(wifi_cache.gateway), IPAddress(wifi_cache.netmask), IPAddress(wifi_cache.dns));
+    } else {
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    }
     if (wasCached) {
         // Connect using a cached bssid and channel
         ESP_LOGD(TAG, "Connecting using cached wifi config");
@@ -290,73 +667,80 @@ boolean connectWifi() {
             ESP.restart();
         }
     }
+    traceMark(TRACE_WIFI_CONNECTED);
+    energyPhase(ENERGY_AWAKE);
+    // Modem sleep keeps us associated between DTIM beacons, which is what lets the CPU light sleep with wifi up
+    WiFi.setSleep(true);
     ESP_LOGI(TAG, "WiFi connect succeeded");
+    LeaseQuery query;
+    runLeaseQuery(&query);
+    if (!usingCachedLease) {
+        storeWifiLease(query);
+    }
     return true;
 }
 
+// Let the CPU light sleep whenever every task is waiting, the row interrupt and wifi wake it back up
+static void enableLightSleep() {
+#if CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t pm = {};
+    pm.max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+    pm.min_freq_mhz = (int) rtc_clk_xtal_freq_get();
+    pm.light_sleep_enable = true;
+    esp_err_t err = esp_pm_configure(&pm);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Couldn't turn on light sleep: %d", err);
+    }
+#endif
+}
+
 void setup() {
+    boolean fromUlp = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_ULP;
+    traceBegin(fromUlp);
+    energyBegin();
+    scannerTask = xTaskGetCurrentTaskHandle();
     // setup hardware
     Serial.begin(115200);
     setuppins();
+    if (!fromUlp) {
+        setupButtonPins();
+    }
 
-    xTaskCreatePinnedToCore(
-        ledLoop,
-        "LEDLoop",
-        1024,
-        NULL,
-        2,
-        NULL,
-        1
-    );
     boolean woke = didJustWake();
 
     if (!woke) {
-        LEDS_lit = 1;
-        delay(250);
-        LEDS_lit = 3;
-        delay(250);
-        LEDS_lit = 7;
-        delay(250);
-        LEDS_lit = 15;
-        delay(250);
-        LEDS_lit = 0;
+        for (uint8_t i = 0; i < NUM_LED_COLUMNS; i++) {
+            ledsOn(1 << i);
+            delay(250);
+        }
+        ledsOff(ALL_LEDS);
     }
     connectWifi();
+    if (fromUlp) {
+        // Anything pressed while we were getting here is waiting in the ULP's ring
+        takeButtonsFromUlp();
+    }
+    enableLightSleep();
 
-    LEDS_lit = 255;
+    ledsOn(ALL_LEDS);
     delay(100);
-    LEDS_lit = 0;
-
-    Preferences prefs;
-    prefs.begin("sonos", true);
-    String addr = prefs.getString("playerAddress", "");
-    String prefUid = prefs.getString("playerUid", "");
-    prefs.end();
-    // If the configured sonos UID is different than what we stored, we need to forget our cached IP
-    if (prefUid != String(SONOS_UID)) {
-        prefs.begin("sonos", false);
-        prefs.remove("playerAddress");
-        prefs.end();
-        addr = String("");
-    }
-    if (addr.length() > 0) {
-        IPAddress ip;
-        ip.fromString(addr.c_str());
-        if (ip) {
-            targetSonos = ip;
-            ESP_LOGI(TAG, "Using cached sonos IP %s", targetSonos.toString().c_str());
-        }
-    }
-    if (!targetSonos) {
-        targetSonos = discoverSonos(std::string(SONOS_UID));
-    }
+    ledsOff(ALL_LEDS);
+
+    // Everything that talks to the player happens on the command task so the buttons keep getting scanned
+    xTaskCreatePinnedToCore(
+        commandLoop,
+        "CommandLoop",
+        8192,
+        NULL,
+        1,
+        &commandTask,
+        COMMAND_TASK_CORE
+    );
+    memoryWatchTask(scannerTask);
+    memoryWatchTask(commandTask);
 }
 
-void napTime() {
-    if (WiFi.isConnected()) {
-        storeWifiCache();
-    }
-    esp_wifi_stop();
+void napTime(uint32_t ulpPeriodUs) {
     ESP_LOGD(TAG, "Starting ULP processor");
 
     for (uint8_t i = 0; i < NUM_BTN_COLUMNS; i++) {
@@ -381,68 +765,315 @@ void napTime() {
         bin_start,
         (bin_end - bin_start) / sizeof(uint32_t)) 
     );
-    // Reset the ULP wake bit to zero in case an intervening run set it to a button and it wasn't cleaned up
-    ulp_wake_gpio_bit = 0;
+    // Loading the binary starts the press ring over empty
     ESP_LOGI(TAG, "Going to sleep now");
     ESP_ERROR_CHECK( ulp_run(&ulp_scan_btns - RTC_SLOW_MEM) );
-    // Wakeup the ULP processor every 100 ms to check for button presses
-    ESP_ERROR_CHECK( ulp_set_wakeup_period(0, 100000) );
+    // Wakeup the ULP processor every so often to check for button presses
+    ESP_ERROR_CHECK( ulp_set_wakeup_period(0, ulpPeriodUs) );
+    energySleep(ulpPeriodUs);
     esp_deep_sleep_start();
 }
 
-// Second layer of sonos operation wrapper to handle the rediscovery logic
-void doSonos(int (*operation)(HTTPClient *http, IPAddress targetSonos)) {
-    if (!targetSonos) {
-        targetSonos = discoverSonos(std::string(SONOS_UID));
+// Nothing answered the search for the player either. Maybe someone else has our old address, get a real lease
+// before next time
+static void targetUnreachable() {
+    if (usingCachedLease) {
+        ESP_LOGW(TAG, "Nothing answered on the cached lease, dropping it");
+        forgetWifiLease();
+    }
+}
+
+// Send command to every player in uids at once, see ButtonAction.targets
+static void fanOut(SonosCommand command, int amount, const char *const *uids) {
+    IPAddress targets[SONOS_FANOUT_MAX];
+    uint8_t count = 0;
+    if (uids[0] == NULL) {
+        count = sonosTopologyCoordinators(targets, SONOS_FANOUT_MAX);
+    }
+    for (; *uids != NULL && count < SONOS_FANOUT_MAX; uids++) {
+        IPAddress address = sonosTopologyAddress(*uids);
+        if (address) {
+            targets[count++] = address;
+        } else {
+            ESP_LOGW(TAG, "Don't know where %s is", *uids);
+        }
+    }
+    if (count == 0) {
+        ESP_LOGE(TAG, "No players to send to, bailing");
+        return;
+    }
+
+    traceMark(TRACE_COMMAND);
+    SonosFanResult results[SONOS_FANOUT_MAX];
+    int failed = sonosFanOut(command, amount, targets, count, results);
+    for (uint8_t i = 0; i < count; i++) {
+        ESP_LOGI(TAG, "%s: %d after %lu ms", results[i].target.toString().c_str(), results[i].error, results[i].ms);
+    }
+    if (failed > 0) {
+        ESP_LOGW(TAG, "%d of %d players didn't take it", failed, count);
+    }
+}
+
+// Send whatever burst we've built up as a single operation
+static void sendPending() {
+    if (pending.action == NULL) {
+        return;
+    }
+    ESP_LOGI(TAG, "Sending %s x%d (amount %d)", pending.action->name, pending.presses, pending.amount);
+    int result = -1;
+    if (pending.action->targets != NULL) {
+        fanOut(pending.action->command, pending.amount, pending.action->targets);
+    } else {
+        boolean canCancel = cancellable(pending.action);
+        if (canCancel) {
+            sending = pending.action;
+        }
+        int error = doSonos(pending.action->operation, pending.amount, canCancel, &result);
+        sending = NULL;
+        if (error == ENO_CANCELLED) {
+            // Nothing reached the player, keep the burst so the press that cancelled it gets added on
+            ESP_LOGI(TAG, "Holding %s x%d for the press that cancelled it", pending.action->name, pending.presses);
+            return;
+        }
+    }
+    ledsOff(pending.buttons);
+    if (pending.action->operation == changeVolume && result >= 0) {
+        ledsShowLevel(result, VOLUME_DISPLAY_MS);
+    }
+
+    pending.action = NULL;
+    pending.amount = 0;
+    pending.presses = 0;
+    pending.buttons = 0;
+}
+
+static void queuePress(const ButtonAction *action, uint8_t button, unsigned long releasedAt) {
+    if (pending.action != NULL && !sameCommand(pending.action, action)) {
+        // A different kind of press ends the burst, keep them in the order they were pressed
+        sendPending();
+    }
+    pending.action = action;
+    pending.amount += action->step;
+    pending.presses++;
+    bitSet(pending.buttons, button);
+    pending.lastPress = releasedAt;
+}
+
+// Take back the last press of action from the burst, so a double tap can replace the tap it started with
+static boolean unqueuePress(const ButtonAction *action) {
+    if (pending.action != action || pending.presses == 0) {
+        return false;
+    }
+    pending.amount -= action->step;
+    pending.presses--;
+    if (pending.presses == 0) {
+        pending.action = NULL;
+    }
+    return true;
+}
+
+static void startRamp(uint8_t button) {
+    // Anything pressed before the hold goes first
+    sendPending();
+    traceMark(TRACE_COMMAND);
+    ramp.action = &buttonActions[button];
+    ramp.button = button;
+    ramp.nextStep = millis();
+    ramp.volume = sonosShadowVolume(sonosTarget());
+}
+
+static void endRamp() {
+    if (ramp.action == NULL) {
+        return;
+    }
+    sonosRampEnd(&ramp.volume);
+    ledsOff(1 << ramp.button);
+    if (ramp.volume >= 0) {
+        ledsShowLevel(ramp.volume, VOLUME_DISPLAY_MS);
+    }
+    ramp.action = NULL;
+}
+
+// Send the next step of the ramp, without waiting on the last one so the steps keep coming at an even rate
+static void rampStep() {
+    ramp.nextStep += VOLUME_RAMP_INTERVAL_MS;
+    if (!sonosTarget()) {
+        return;
+    }
+    int adjustment = ramp.action->step > 0 ? VOLUME_RAMP_STEP : -VOLUME_RAMP_STEP;
+    if ((adjustment > 0 && ramp.volume >= 100) || (adjustment < 0 && ramp.volume == 0)) {
+        // Already as far as it goes, keep holding without pestering the player
+        return;
     }
-    if (!targetSonos) {
-        ESP_LOGE(TAG, "Couldn't find the right sonos, bailing");
+    int error = sonosRampVolume(sonosTarget(), adjustment, &ramp.volume);
+    if (error == ENO_CANTCONNECT) {
+        ESP_LOGW(TAG, "Lost the player mid ramp, stopping");
+        endRamp();
+        lostTarget();
         return;
     }
+    if (ramp.volume >= 0) {
+        ledsShowLevel(ramp.volume, VOLUME_DISPLAY_MS);
+    }
+}
 
-    int error = sonosOperation(operation, targetSonos);
-    if (error) {
-        // try rediscovering
-        targetSonos = discoverSonos(std::string(SONOS_UID));
+static void handleGesture(const PressEvent &event) {
+    switch (event.gesture) {
+        case GESTURE_DOUBLE_TAP:
+            if (buttonActions[event.button].doubleTap != NULL) {
+                // The first tap was queued as a plain tap, it's part of the double tap now
+                unqueuePress(&buttonActions[event.button]);
+            }
+            break;
+        case GESTURE_HOLD_START:
+            startRamp(event.button);
+            return;
+        case GESTURE_HOLD_END:
+            endRamp();
+            return;
+        default:
+            break;
+    }
+    queuePress(gestureAction(event.button, event.gesture), event.button, event.at);
+}
+
+// Drop the subscriptions and the radio, this has to happen on the command task so it can't race a request
+static void stopNetwork() {
+    if (WiFi.isConnected()) {
+        checkWifiLease();
+        storeWifiCache();
+    }
+    sonosEventsEnd();
+    sonosCloseConnections();
+    esp_wifi_stop();
+}
+
+// Stay associated but stop listening for events, and let the radio sleep through more beacons
+static void doze() {
+    sonosEventsEnd();
+    sonosCloseConnections();
+    esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+    energyPhase(ENERGY_DOZE);
+}
+
+static void undoze() {
+    energyPhase(ENERGY_AWAKE);
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+    sonosEventsBegin();
+}
+
+// The command task: drains the presses the scanner queues and does all the talking to the player
+void commandLoop(void *args) {
+    sonosTargetBegin(SONOS_UID, targetUnreachable);
+    findTargetSonos();
+    if (sonosTarget()) {
+        traceMark(TRACE_TARGET_FOUND);
+    }
+    sonosEventsBegin();
+    boolean dozing = false;
+
+    for (;;) {
+        PressEvent event;
+        commandBusy = true;
+        if (dozing && !dozeRequested) {
+            undoze();
+            dozing = false;
+        }
+        if (pressQueuePop(&event)) {
+            handleGesture(event);
+            continue;
+        }
+        if (ramp.action != NULL) {
+            long wait = (long) (ramp.nextStep - millis());
+            if (wait <= 0) {
+                rampStep();
+            } else {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+            }
+            continue;
+        }
+        if (pending.action != NULL) {
+            unsigned long waited = millis() - pending.lastPress;
+            if (waited >= COALESCE_WINDOW_MS) {
+                sendPending();
+            } else {
+                // Wait out the rest of the window, or until the next press arrives
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(COALESCE_WINDOW_MS - waited));
+            }
+            continue;
+        }
+        commandBusy = false;
+
+        if (napRequested) {
+            stopNetwork();
+            networkDown = true;
+            vTaskSuspend(NULL);
+        }
+        if (dozeRequested) {
+            if (!dozing) {
+                doze();
+                dozing = true;
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        // Keep the event subscriptions going while we're idle so the next press can skip the state lookups
+        sonosEventsPoll(sonosTarget());
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(COMMAND_IDLE_WAIT_MS));
     }
 }
 
 void loop() {
-    static int idleLoopCount = 0;
-
-    int handle_buttons = buttons_released | sleep_buttons;
-    // Clear the sleep_buttons variable so we only handle it once
-    sleep_buttons = 0;
-    scan();
-    if (handle_buttons != 0) {
-        idleLoopCount = 0;
-        if (bitRead(handle_buttons, 0)) {
-            ESP_LOGI(TAG, "Sending play/pause");
-            doSonos(sonosPlay);
-            bitClear(LEDS_lit, 0);
-        } else if (bitRead(handle_buttons, 1)) { 
-            ESP_LOGI(TAG, "Sending next");
-            doSonos(sonosNext);
-            bitClear(LEDS_lit, 1);
-        } else if (bitRead(handle_buttons, 2)) {
-            ESP_LOGI(TAG, "Sending volume up");
-            doSonos(volumeUp);
-            bitClear(LEDS_lit, 2);
-        } else if (bitRead(handle_buttons, 3)) {
-            ESP_LOGI(TAG, "Sending volume down");
-            doSonos(volumeDown);
-            bitClear(LEDS_lit, 3);
-        } else {
-            ESP_LOGE(TAG, "Not implemented");
-            delay(1000);
-            LEDS_lit = 0;
+    static unsigned long lastActive = millis();
+    static TickType_t lastScan = xTaskGetTickCount();
+    static SleepPolicy policy = sleepPolicyChoose();
+
+    boolean active = scan();
+    // Send a t over serial to see where the time goes between waking up and the player doing something, and what it
+    // costs the battery.
+    // It gets read the next time we wake up to scan
+    if (Serial.available() && Serial.read() == 't') {
+        traceDump();
+        memoryDump();
+        sleepPolicyDump();
+        sonosRttDump();
+        energyDump();
+    }
+
+    unsigned long now = millis();
+    if (active || !pressQueueEmpty() || commandBusy) {
+        if (dozeRequested) {
+            // Get the subscriptions going again while the button's still down
+            dozeRequested = false;
+            xTaskNotifyGive(commandTask);
         }
-    } else {
-        delay(5);
-        idleLoopCount += 1;
-        if (idleLoopCount >= IDLE_LOOPS_SLEEPY) {
-            idleLoopCount = 0;
-            napTime();
+        policy = sleepPolicyChoose();
+        lastActive = now;
+    } else if (!dozeRequested && policy.dozeMs > 0 && now - lastActive >= policy.awakeMs) {
+        ESP_LOGI(TAG, "Dozing for %lus, %u%% of presses after this long have come by then",
+            (unsigned long) policy.dozeMs / 1000, policy.dozeCoverage);
+        dozeRequested = true;
+        xTaskNotifyGive(commandTask);
+    } else if (now - lastActive >= policy.awakeMs + policy.dozeMs) {
+        ESP_LOGI(TAG, "Deep sleep with the ULP scanning every %lums", (unsigned long) policy.ulpPeriodUs / 1000);
+        // Nothing else gets queued once we stop scanning, so the command task is done once it answers
+        napRequested = true;
+        xTaskNotifyGive(commandTask);
+        while (!networkDown) {
+            delay(1);
         }
+        napTime(policy.ulpPeriodUs);
+    }
+
+    if (active) {
+        // Keep a steady scan rate until everything's let go, that's what fixes the press latency
+        vTaskDelayUntil(&lastScan, pdMS_TO_TICKS(SCAN_PERIOD_MS));
+    } else {
+        // Sleep until a row goes low, or it's time to move to the next sleep tier
+        unsigned long idle = now - lastActive;
+        unsigned long next = idle < policy.awakeMs ? policy.awakeMs : policy.awakeMs + policy.dozeMs;
+        armButtonInterrupt();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(next > idle ? next - idle : 1));
+        lastScan = xTaskGetTickCount();
     }
 }
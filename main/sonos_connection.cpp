@@ -0,0 +1,738 @@
+#include <Arduino.h>
+#include <lwip/sockets.h>
+#include <string.h>
+#include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_memory.h"
+#include "sonos_rtt.h"
+
+// Where cancellation is up to, see sonosCancel()
+#define CANCEL_OFF 0
+#define CANCEL_ARMED 1
+#define CANCEL_REQUESTED 2
+
+static SonosConnection pool[SONOS_POOL_SIZE];
+
+static volatile uint8_t cancelState = CANCEL_OFF;
+
+SonosConnection::SonosConnection() :
+    fd(-1),
+    connecting(false),
+    connectStarted(0),
+    rxPos(0),
+    rxLen(0),
+    remaining(0),
+    chunked(false),
+    keepAlive(false),
+    inFlight(0),
+    lastUsed(0),
+    connectTimeout(0),
+    timeout(0),
+    deadline(0),
+    sentAt(0),
+    sent(false),
+    capturedName(NULL),
+    capturedValue(NULL),
+    capturedLen(0) {
+}
+
+// Wait until one of the sockets can be written to (or read from when not writing). Returns the index of the first
+// that can, -1 if until passes first, or SONOS_ERROR_CANCELLED. select wakes up every SONOS_CANCEL_CHECK_MS to look for a cancel
+static int waitSockets(const int *sockets, uint8_t count, boolean writing, unsigned long until) {
+    for (;;) {
+        if (cancelState == CANCEL_REQUESTED) {
+            return SONOS_ERROR_CANCELLED;
+        }
+        long left = (long) (until - millis());
+        if (left <= 0) {
+            return -1;
+        }
+        if (left > SONOS_CANCEL_CHECK_MS) {
+            left = SONOS_CANCEL_CHECK_MS;
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        int maxfd = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            FD_SET(sockets[i], &fds);
+            if (sockets[i] > maxfd) {
+                maxfd = sockets[i];
+            }
+        }
+        struct timeval slice = { 0, left * 1000 };
+        int ready = lwip_select(maxfd + 1, writing ? NULL : &fds, writing ? &fds : NULL, NULL, &slice);
+        if (ready < 0) {
+            return -1;
+        }
+        for (uint8_t i = 0; ready > 0 && i < count; i++) {
+            if (FD_ISSET(sockets[i], &fds)) {
+                return i;
+            }
+        }
+    }
+}
+
+// Wait for the socket like waitSockets(), returns 0 once it's ready or timeoutError. Missing a deadline backs off the player's timeout
+int SonosConnection::wait(boolean writing, unsigned long until, int timeoutError) {
+    int ready = waitSockets(&fd, 1, writing, until);
+    if (ready == SONOS_ERROR_CANCELLED) {
+        return ready;
+    }
+    if (ready < 0) {
+        sonosRttTimedOut(target);
+        return timeoutError;
+    }
+    return 0;
+}
+
+uint32_t SonosConnection::requestTimeout() {
+    return timeout > 0 ? timeout : sonosRttTimeout(target);
+}
+
+uint32_t SonosConnection::connectTimeoutMs() {
+    return connectTimeout > 0 ? connectTimeout : sonosRttConnectTimeout(target);
+}
+
+// Pull whatever has arrived of the response into rxBuf, waiting for some if nothing has.
+// Returns how much came, 0 if the player closed the socket, or a SONOS_ERROR_*
+int SonosConnection::fill() {
+    rxPos = 0;
+    rxLen = 0;
+    for (;;) {
+        int count = lwip_recv(fd, rxBuf, sizeof(rxBuf), 0);
+        if (count > 0) {
+            rxLen = count;
+            // The response is coming, from here on the timeout is for it going quiet
+            deadline = millis() + requestTimeout();
+            return count;
+        }
+        if (count == 0) {
+            keepAlive = false;
+            return 0;
+        }
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+            return SONOS_ERROR_READ;
+        }
+        int error = wait(false, deadline, SONOS_ERROR_TIMEOUT);
+        if (error < 0) {
+            return error;
+        }
+    }
+}
+
+int SonosConnection::readByte() {
+    if (rxPos == rxLen) {
+        int count = fill();
+        if (count <= 0) {
+            return count < 0 ? count : SONOS_ERROR_READ;
+        }
+    }
+    return rxBuf[rxPos++];
+}
+
+// Read a single header line without the trailing CRLF, returns the length or a SONOS_ERROR_*
+int SonosConnection::readLine(char *buf, size_t len) {
+    size_t pos = 0;
+    for (;;) {
+        int c = readByte();
+        if (c < 0) {
+            return c;
+        }
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && pos < len - 1) {
+            buf[pos++] = c;
+        }
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+// Throw away anything left over from the last response. Returns false if the player has closed the socket,
+// which it does to kept-alive ones after a while idle
+boolean SonosConnection::drain() {
+    rxPos = 0;
+    rxLen = 0;
+    if (fd < 0) {
+        return false;
+    }
+    for (;;) {
+        int count = lwip_recv(fd, rxBuf, sizeof(rxBuf), 0);
+        if (count == 0) {
+            return false;
+        }
+        if (count < 0) {
+            // Nothing waiting is what a healthy idle socket looks like
+            return errno == EWOULDBLOCK || errno == EAGAIN;
+        }
+    }
+}
+
+// Open a fresh socket to the player and start it connecting without waiting
+boolean SonosConnection::startConnect() {
+    close();
+    memoryConnectionOpened();
+    fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        Serial.printf("Out of sockets connecting to %s\n", target.toString().c_str());
+        return false;
+    }
+    lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    lwip_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SONOS_PORT);
+    address.sin_addr.s_addr = (uint32_t) target;
+    if (lwip_connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+        Serial.printf("Couldn't connect to %s\n", target.toString().c_str());
+        close();
+        return false;
+    }
+    connecting = true;
+    connectStarted = millis();
+    return true;
+}
+
+// Start a socket of its own connecting to target, without waiting. Returns it, or -1 if it couldn't be started
+static int startProbe(IPAddress target) {
+    memoryConnectionOpened();
+    int probe = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (probe < 0) {
+        return -1;
+    }
+    lwip_fcntl(probe, F_SETFL, lwip_fcntl(probe, F_GETFL, 0) | O_NONBLOCK);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SONOS_PORT);
+    address.sin_addr.s_addr = (uint32_t) target;
+    if (lwip_connect(probe, (struct sockaddr *) &address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+        lwip_close(probe);
+        return -1;
+    }
+    return probe;
+}
+
+/*
+ * A request on a kept-alive socket is taking longer than most do. When the player has moved to a new address the
+ * old one goes quiet rather than refusing us, so left alone we'd wait out the whole request timeout to find out.
+ * A fresh connect to the same address only gets the connect timeout, and tells a player that's there but slow
+ * from one that isn't there at all. Returns 0 to carry on waiting for the response, SONOS_ERROR_CONNECT if nothing
+ * is at the address anymore or SONOS_ERROR_CANCELLED
+ */
+int SonosConnection::awaitReused() {
+    int ready = waitSockets(&fd, 1, false, sentAt + sonosRttHedgeAfter(target));
+    if (ready == SONOS_ERROR_CANCELLED) {
+        return ready;
+    }
+    int probe = ready < 0 ? startProbe(target) : -1;
+    if (probe < 0) {
+        // Answered after all, or we can't tell
+        return 0;
+    }
+    // Whichever comes first, the response or the connect
+    unsigned long until = millis() + sonosRttConnectTimeout(target);
+    int error = SONOS_ERROR_CONNECT;
+    for (;;) {
+        if (cancelState == CANCEL_REQUESTED) {
+            error = SONOS_ERROR_CANCELLED;
+            break;
+        }
+        long left = (long) (until - millis());
+        if (left <= 0) {
+            break;
+        }
+        if (left > SONOS_CANCEL_CHECK_MS) {
+            left = SONOS_CANCEL_CHECK_MS;
+        }
+        fd_set readable, writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(fd, &readable);
+        FD_SET(probe, &writable);
+        struct timeval slice = { 0, left * 1000 };
+        if (lwip_select((fd > probe ? fd : probe) + 1, &readable, &writable, NULL, &slice) < 0) {
+            break;
+        }
+        if (FD_ISSET(fd, &readable)) {
+            error = 0;
+            break;
+        }
+        if (FD_ISSET(probe, &writable)) {
+            int socketError = 0;
+            socklen_t len = sizeof(socketError);
+            lwip_getsockopt(probe, SOL_SOCKET, SO_ERROR, &socketError, &len);
+            error = socketError == 0 ? 0 : SONOS_ERROR_CONNECT;
+            break;
+        }
+    }
+    lwip_close(probe);
+    if (error == SONOS_ERROR_CONNECT) {
+        Serial.printf("Nothing at %s anymore\n", target.toString().c_str());
+        // There was nobody to take the request, so it can go to wherever the player is now
+        sent = false;
+    }
+    return error;
+}
+
+// Wait for a started connect to finish, it gets the connect timeout from when it started
+int SonosConnection::finishConnect() {
+    int error = wait(true, connectStarted + connectTimeoutMs(), SONOS_ERROR_CONNECT);
+    if (error == 0) {
+        int socketError = 0;
+        socklen_t len = sizeof(socketError);
+        lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &socketError, &len);
+        if (socketError != 0) {
+            error = SONOS_ERROR_CONNECT;
+        }
+    }
+    if (error < 0) {
+        if (error == SONOS_ERROR_CONNECT) {
+            Serial.printf("Couldn't connect to %s\n", target.toString().c_str());
+        }
+        close();
+        return error;
+    }
+    connecting = false;
+    return 0;
+}
+
+// Get a socket ready to send on, the kept-alive one if the player hasn't closed it (reused is set then)
+// or a new one. Returns 0 or a SONOS_ERROR_*
+int SonosConnection::ready(boolean *reused) {
+    *reused = false;
+    if (!connecting) {
+        if (drain()) {
+            *reused = true;
+            return 0;
+        }
+        if (!startConnect()) {
+            return SONOS_ERROR_CONNECT;
+        }
+    }
+    return finishConnect();
+}
+
+void SonosConnection::prepare() {
+    if (inFlight == 0 && !connecting && !drain()) {
+        startConnect();
+    }
+}
+
+static void soapHeaders(char *headers, size_t len, const char *soapAction) {
+    snprintf(headers, len,
+        "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+        "SOAPACTION: %s\r\n",
+        soapAction);
+}
+
+int SonosConnection::sendAll(const char *data, size_t length) {
+    while (length > 0) {
+        int count = lwip_send(fd, data, length, 0);
+        if (count > 0) {
+            data += count;
+            length -= count;
+            continue;
+        }
+        if (count < 0 && errno != EWOULDBLOCK && errno != EAGAIN) {
+            return SONOS_ERROR_SEND;
+        }
+        // The send buffer is full, wait for the player to take some of it
+        int error = wait(true, deadline, SONOS_ERROR_TIMEOUT);
+        if (error < 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+int SonosConnection::writeRequest(const char *method, const char *path, const char *extraHeaders, const char *body, size_t length) {
+    sent = false;
+    deadline = millis() + requestTimeout();
+    char header[384];
+    int headerLen = snprintf(header, sizeof(header),
+        "%s %s HTTP/1.1\r\n"
+        "HOST: %u.%u.%u.%u:%d\r\n"
+        "%s"
+        "Content-Length: %u\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n",
+        method, path, target[0], target[1], target[2], target[3], SONOS_PORT, extraHeaders, (unsigned int) length);
+    if (headerLen >= (int) sizeof(header)) {
+        return SONOS_ERROR_SEND;
+    }
+
+    int error = sendAll(header, headerLen);
+    if (error == 0 && length > 0) {
+        error = sendAll(body, length);
+    }
+    sent = error == 0;
+    sentAt = millis();
+    return error;
+}
+
+// Parse the status line and the headers we care about, leaving the socket at the start of the body
+int SonosConnection::readHeaders() {
+    char line[128];
+    int error = readLine(line, sizeof(line));
+    if (error < 0) {
+        return error;
+    }
+    // HTTP/1.1 200 OK
+    const char *status = strchr(line, ' ');
+    if (status == NULL) {
+        return SONOS_ERROR_READ;
+    }
+    int httpCode = atoi(status + 1);
+    keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+    chunked = false;
+    remaining = -1;
+
+    for (;;) {
+        int len = readLine(line, sizeof(line));
+        if (len < 0) {
+            return len;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            remaining = atoi(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked")) {
+            chunked = true;
+            remaining = 0;
+        } else if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line, "close")) {
+            keepAlive = false;
+        } else if (capturedName != NULL) {
+            size_t nameLen = strlen(capturedName);
+            if (strncasecmp(line, capturedName, nameLen) == 0 && line[nameLen] == ':') {
+                const char *value = line + nameLen + 1;
+                while (*value == ' ') {
+                    value++;
+                }
+                strncpy(capturedValue, value, capturedLen - 1);
+                capturedValue[capturedLen - 1] = '\0';
+            }
+        }
+    }
+    if (remaining < 0) {
+        // No length, so the body is delimited by the player closing the socket
+        keepAlive = false;
+    }
+    return httpCode;
+}
+
+void SonosConnection::captureHeader(const char *name, char *value, size_t len) {
+    capturedName = name;
+    capturedValue = value;
+    capturedLen = len;
+    value[0] = '\0';
+}
+
+int SonosConnection::post(const char *path, const char *soapAction, const char *body, size_t length) {
+    char headers[160];
+    soapHeaders(headers, sizeof(headers), soapAction);
+    return request("POST", path, headers, body, length);
+}
+
+int SonosConnection::post(const SoapAction &action) {
+    return post(action.path, action.soapAction, action.body, action.length);
+}
+
+int SonosConnection::post(const SoapTemplate &action, int value) {
+    char body[SOAP_MAX_BODY];
+    size_t length = soapFill(action, value, body);
+    return post(action.path, action.soapAction, body, length);
+}
+
+int SonosConnection::pipeline(const SoapAction &action) {
+    return pipeline(action.path, action.soapAction, action.body, action.length);
+}
+
+int SonosConnection::pipeline(const SoapTemplate &action, int value) {
+    char body[SOAP_MAX_BODY];
+    size_t length = soapFill(action, value, body);
+    return pipeline(action.path, action.soapAction, body, length);
+}
+
+int SonosConnection::pipeline(const char *path, const char *soapAction, const char *body, size_t length) {
+    sent = false;
+    // Don't even connect for a request that's already been cancelled
+    if (cancelState == CANCEL_REQUESTED) {
+        return SONOS_ERROR_CANCELLED;
+    }
+    if (inFlight == 0) {
+        boolean reused;
+        int error = ready(&reused);
+        if (error < 0) {
+            return error;
+        }
+    }
+    char headers[160];
+    soapHeaders(headers, sizeof(headers), soapAction);
+    int error = writeRequest("POST", path, headers, body, length);
+    if (error < 0) {
+        // Whatever was queued up behind the socket is gone with it
+        close();
+        return error;
+    }
+    inFlight++;
+    return 0;
+}
+
+int SonosConnection::response() {
+    if (inFlight == 0) {
+        return SONOS_ERROR_READ;
+    }
+    // With more than one in flight this one's been queued behind the others, so only time a lone one
+    boolean timed = inFlight == 1;
+    inFlight--;
+    deadline = millis() + requestTimeout();
+    int httpCode = readHeaders();
+    if (httpCode < 0) {
+        close();
+    } else {
+        lastUsed = millis();
+        if (timed) {
+            sonosRttSample(target, lastUsed - sentAt);
+        }
+    }
+    return httpCode;
+}
+
+int SonosConnection::request(const char *method, const char *path, const char *extraHeaders, const char *body, size_t length) {
+    if (inFlight > 0) {
+        // Someone left pipelined responses unread, we can't tell which answer is ours so start over
+        close();
+    }
+    sent = false;
+    if (cancelState == CANCEL_REQUESTED) {
+        capturedName = NULL;
+        return SONOS_ERROR_CANCELLED;
+    }
+    int httpCode = SONOS_ERROR_CONNECT;
+    for (uint8_t attempt = 0; attempt < 2; attempt++) {
+        boolean reused;
+        httpCode = ready(&reused);
+        if (httpCode == 0) {
+            httpCode = writeRequest(method, path, extraHeaders, body, length);
+        }
+        if (httpCode == 0 && reused) {
+            httpCode = awaitReused();
+        }
+        if (httpCode == 0) {
+            httpCode = readHeaders();
+        }
+        if (httpCode > 0) {
+            lastUsed = millis();
+            sonosRttSample(target, lastUsed - sentAt);
+            break;
+        }
+
+        // A response we stopped waiting for could still turn up, so the socket can't be used again
+        close();
+        if (httpCode == SONOS_ERROR_CONNECT && !reused) {
+            // lwip waits seconds to resend a lost SYN, a fresh connect once the player's measured timeout is up is quicker
+            Serial.printf("Connecting to %s timed out, trying again\n", target.toString().c_str());
+        } else if (reused && !sent && httpCode == SONOS_ERROR_SEND) {
+            // The player dropped the kept-alive socket under us before the request got out, try again on a fresh
+            // one. Not once it's gone out, the player may have carried it out and not everything is safe to send twice
+            Serial.printf("Kept-alive connection to %s went stale, reconnecting\n", target.toString().c_str());
+        } else {
+            break;
+        }
+    }
+    capturedName = NULL;
+    return httpCode;
+}
+
+int SonosConnection::read(char *buf, size_t len) {
+    if (chunked && remaining == 0) {
+        char line[16];
+        int error = readLine(line, sizeof(line));
+        // Chunks after the first are preceded by the CRLF ending the previous one
+        if (error == 0) {
+            error = readLine(line, sizeof(line));
+        }
+        if (error < 0) {
+            return error;
+        }
+        remaining = strtol(line, NULL, 16);
+        if (remaining == 0) {
+            // Last chunk, eat the empty trailer line
+            readLine(line, sizeof(line));
+            chunked = false;
+            return 0;
+        }
+    }
+    if (remaining == 0) {
+        return 0;
+    }
+
+    if (rxPos == rxLen) {
+        int count = fill();
+        if (count == 0) {
+            // Unbounded bodies end when the socket does
+            return remaining < 0 ? 0 : SONOS_ERROR_READ;
+        }
+        if (count < 0) {
+            return count;
+        }
+    }
+    size_t count = rxLen - rxPos;
+    if (count > len) {
+        count = len;
+    }
+    if (remaining > 0 && (size_t) remaining < count) {
+        count = remaining;
+    }
+    memcpy(buf, rxBuf + rxPos, count);
+    rxPos += count;
+    if (remaining > 0) {
+        remaining -= count;
+    }
+    return count;
+}
+
+std::string SonosConnection::body() {
+    std::string result;
+    char buf[256];
+    int count;
+    while ((count = read(buf, sizeof(buf))) > 0) {
+        result.append(buf, count);
+    }
+    return result;
+}
+
+void SonosConnection::finish() {
+    char buf[128];
+    int count;
+    while ((count = read(buf, sizeof(buf))) > 0) {
+    }
+    if (count < 0 || !keepAlive) {
+        close();
+    }
+}
+
+void SonosConnection::close() {
+    if (fd >= 0) {
+        lwip_close(fd);
+        fd = -1;
+    }
+    connecting = false;
+    rxPos = 0;
+    rxLen = 0;
+    remaining = 0;
+    chunked = false;
+    inFlight = 0;
+}
+
+SonosConnection *sonosConnection(IPAddress target) {
+    SonosConnection *oldest = NULL;
+    for (uint8_t i = 0; i < SONOS_POOL_SIZE; i++) {
+        if (pool[i].target == target) {
+            return &pool[i];
+        }
+        // Someone's still waiting on this one's responses, or is about to send on it once it connects
+        if (pool[i].inFlight > 0 || pool[i].connecting) {
+            continue;
+        }
+        if (oldest == NULL || pool[i].lastUsed < oldest->lastUsed) {
+            oldest = &pool[i];
+        }
+    }
+    if (oldest == NULL) {
+        // Everything's busy, which only happens if someone forgot to read their responses
+        oldest = &pool[0];
+    }
+    // Nothing pooled for this player yet, take over the least recently used slot
+    oldest->close();
+    oldest->target = target;
+    oldest->lastUsed = millis();
+    return oldest;
+}
+
+void sonosCloseConnections() {
+    for (uint8_t i = 0; i < SONOS_POOL_SIZE; i++) {
+        pool[i].close();
+        pool[i].target = IPAddress();
+    }
+}
+
+void sonosCancelBegin() {
+    cancelState = CANCEL_ARMED;
+}
+
+void sonosCancelEnd() {
+    cancelState = CANCEL_OFF;
+}
+
+void sonosCancel() {
+    // Only an armed request can be cancelled, and it has to be done in one step so a cancel can't land just after sonosCancelEnd()
+    uint8_t armed = CANCEL_ARMED;
+    if (__atomic_compare_exchange_n(&cancelState, &armed, CANCEL_REQUESTED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        Serial.println("Cancelling the request in progress");
+    }
+}
+
+int sonosHedgedPost(IPAddress primary, IPAddress backup, const SoapAction &action, SonosConnection **connOut) {
+    SonosConnection *first = sonosConnection(primary);
+    *connOut = first;
+    if (!backup || backup == primary) {
+        return first->post(action);
+    }
+    int error = first->pipeline(action);
+    if (error < 0) {
+        return error;
+    }
+    int ready = waitSockets(&first->fd, 1, false, first->sentAt + sonosRttHedgeAfter(primary));
+    if (ready == SONOS_ERROR_CANCELLED) {
+        first->close();
+        return ready;
+    }
+    SonosConnection *second = NULL;
+    if (ready < 0) {
+        // The primary is later than it usually is, ask the backup as well. The primary's slot can't be
+        // taken over for it while the primary's response is still to read
+        second = sonosConnection(backup);
+        if (second->pipeline(action) < 0) {
+            second = NULL;
+        }
+    }
+    if (second == NULL) {
+        return first->response();
+    }
+
+    int sockets[] = { first->fd, second->fd };
+    unsigned long until = first->deadline;
+    if ((long) (second->deadline - until) > 0) {
+        until = second->deadline;
+    }
+    ready = waitSockets(sockets, 2, false, until);
+    if (ready < 0) {
+        first->close();
+        second->close();
+        if (ready == SONOS_ERROR_CANCELLED) {
+            return ready;
+        }
+        sonosRttTimedOut(primary);
+        sonosRttTimedOut(backup);
+        return SONOS_ERROR_TIMEOUT;
+    }
+    SonosConnection *winner = ready == 0 ? first : second;
+    SonosConnection *loser = ready == 0 ? second : first;
+    if (loser == first) {
+        // All we know is the primary took at least this long, which is still worth counting
+        sonosRttSample(primary, millis() - first->sentAt);
+    }
+    Serial.printf("Hedged %s to %s, %s answered first\n", action.soapAction, backup.toString().c_str(),
+        winner->target.toString().c_str());
+    sonosRttHedged(winner == second);
+    loser->close();
+    *connOut = winner;
+    return winner->response();
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <Arduino.h>
+#include <string>
+#include "soap.h"
+
+// How many players we keep a warm keep-alive socket open to
+#define SONOS_POOL_SIZE 4
+// How much of a response we pull off the socket at a time
+#define SONOS_RX_BUFFER 256
+// How often a request waiting on the network checks whether it's been cancelled
+#define SONOS_CANCEL_CHECK_MS 10
+
+// Negative return codes from SonosConnection::post, real http status codes are positive
+#define SONOS_ERROR_CONNECT -1
+#define SONOS_ERROR_SEND -2
+#define SONOS_ERROR_READ -3
+// sonosCancel() stopped the request
+#define SONOS_ERROR_CANCELLED -4
+// The player didn't answer in time
+#define SONOS_ERROR_TIMEOUT -5
+
+/**
+ * A single keep-alive HTTP/1.1 connection to a sonos player.
+ *
+ * The socket is left open between requests so that every operation after the first one inside
+ * the awake window skips the TCP handshake. If the player closed its end while we were idle the
+ * request is transparently retried on a fresh socket.
+ *
+ * The socket is a non-blocking lwip one and every wait on it goes through select, so a request
+ * never takes longer than its timeout whatever the player does, and one that was made cancellable
+ * with sonosCancelBegin() can be given up on part way by sonosCancel(). Unless they're set the
+ * timeouts come from the round trips measured to the player, see sonos_rtt.h.
+ */
+class SonosConnection {
+    public:
+        SonosConnection();
+
+        // POST a SOAP body and read the response headers. Returns the http status code or a SONOS_ERROR_*
+        int post(const char *path, const char *soapAction, const char *body, size_t length);
+        int post(const SoapAction &action);
+        // Fill in the template's field with value on the stack and POST it
+        int post(const SoapTemplate &action, int value);
+
+        // Start connecting if there's no open socket, without waiting for it. Lets the sockets to several
+        // players come up at the same time before pipeline() waits on each of them
+        void prepare();
+
+        // Send a request without waiting for its response, so the next one can go out right behind it.
+        // Every pipelined request needs a matching response() before the connection is used for anything else
+        int pipeline(const char *path, const char *soapAction, const char *body, size_t length);
+        int pipeline(const SoapAction &action);
+        int pipeline(const SoapTemplate &action, int value);
+        // Read the headers of the oldest pipelined response. Returns the http status code or a SONOS_ERROR_*
+        int response();
+        // How many pipelined requests we haven't read the response to yet
+        uint8_t pipelined() { return inFlight; }
+
+        // Send any other request, extraHeaders are complete CRLF terminated header lines
+        int request(const char *method, const char *path, const char *extraHeaders, const char *body, size_t length);
+
+        // Save the value of a response header from the next request into value
+        void captureHeader(const char *name, char *value, size_t len);
+
+        // Read up to len bytes of the response body. Returns 0 at the end of the body, negative on error
+        int read(char *buf, size_t len);
+
+        // Read the rest of the response body into a string, mostly for logging
+        std::string body();
+
+        // Discard whatever is left of the response so the socket can carry the next request
+        void finish();
+
+        void close();
+
+        // How long to wait for a new socket to connect, 0 (the default) for the player's measured timeout
+        void setConnectTimeout(int timeout) { connectTimeout = timeout; }
+        // How long a request gets from being sent to its response starting to arrive, and then each time the response
+        // goes quiet. A pipelined request's time starts over when response() starts waiting for it. 0 (the default) for
+        // the player's measured timeout
+        void setTimeout(int ms) { timeout = ms; }
+
+        // Whether all of the last request went out. A request that failed after that may still have been carried out
+        boolean requestSent() { return sent; }
+
+        IPAddress address() { return target; }
+
+    private:
+        friend SonosConnection *sonosConnection(IPAddress target);
+        friend void sonosCloseConnections();
+        friend int sonosHedgedPost(IPAddress primary, IPAddress backup, const SoapAction &action, SonosConnection **connOut);
+
+        boolean startConnect();
+        int finishConnect();
+        int ready(boolean *reused);
+        boolean drain();
+        int wait(boolean writing, unsigned long until, int timeoutError);
+        uint32_t requestTimeout();
+        uint32_t connectTimeoutMs();
+        int sendAll(const char *data, size_t length);
+        int writeRequest(const char *method, const char *path, const char *extraHeaders, const char *body, size_t length);
+        int fill();
+        int readHeaders();
+        int awaitReused();
+        int readLine(char *buf, size_t len);
+        int readByte();
+
+        int fd;
+        // connect() has been started but we haven't seen it finish yet
+        boolean connecting;
+        unsigned long connectStarted;
+        uint8_t rxBuf[SONOS_RX_BUFFER];
+        size_t rxPos;
+        size_t rxLen;
+        IPAddress target;
+        // Bytes left in the body (or the current chunk), -1 if the body runs until the socket closes
+        int remaining;
+        boolean chunked;
+        boolean keepAlive;
+        uint8_t inFlight;
+        unsigned long lastUsed;
+        int connectTimeout;
+        int timeout;
+        // When the request in progress has to be done by
+        unsigned long deadline;
+        // When the last request finished going out
+        unsigned long sentAt;
+        boolean sent;
+        const char *capturedName;
+        char *capturedValue;
+        size_t capturedLen;
+};
+
+// Get the pooled connection for a player, opening a slot for it if we don't have one yet. Slots with
+// pipelined responses still to read or a prepare()d connect under way are never taken over, so up to
+// SONOS_POOL_SIZE players can have requests in flight at once
+SonosConnection *sonosConnection(IPAddress target);
+
+// Close every pooled socket, called before the radio goes down
+void sonosCloseConnections();
+
+// POST an action that's safe to send twice to primary, and to backup as well if primary hasn't started answering
+// by its usual worst case. Whichever answers first wins and the other's socket is closed. Returns the winner's
+// http status code or a SONOS_ERROR_*, with *connOut left at the start of its response body
+int sonosHedgedPost(IPAddress primary, IPAddress backup, const SoapAction &action, SonosConnection **connOut);
+
+// Let sonosCancel() stop the requests made from here until sonosCancelEnd(), from the task making them
+void sonosCancelBegin();
+void sonosCancelEnd();
+
+// Called from any task to give up on the cancellable request in progress, it fails with SONOS_ERROR_CANCELLED within
+// SONOS_CANCEL_CHECK_MS and so does every request after it until sonosCancelEnd(). Does nothing if there's no
+// cancellable request, so discovery and topology reads are never cut short
+void sonosCancel();
@@ -0,0 +1,378 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include <string.h>
+#include <expat.h>
+#include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_events.h"
+#include "sonos_memory.h"
+#include "sonos_topology.h"
+#include "energy.h"
+#include "sonos_xml.h"
+
+typedef struct {
+    // Event URL on the player
+    const char *eventPath;
+    // Where the player sends NOTIFYs for this subscription on our side
+    const char *callbackPath;
+    char sid[64];
+    unsigned long expires;
+    unsigned long lastAttempt;
+} Subscription;
+
+static Subscription subscriptions[] = {
+    { "/MediaRenderer/AVTransport/Event", "/avt", "", 0, 0 },
+    { "/MediaRenderer/RenderingControl/Event", "/rc", "", 0, 0 },
+    { "/ZoneGroupTopology/Event", "/zgt", "", 0, 0 }
+};
+#define NUM_SUBSCRIPTIONS (sizeof(subscriptions) / sizeof(subscriptions[0]))
+#define AVT_SUBSCRIPTION (&subscriptions[0])
+#define RC_SUBSCRIPTION (&subscriptions[1])
+#define ZGT_SUBSCRIPTION (&subscriptions[2])
+
+static struct {
+    IPAddress player;
+    char transportState[24];
+    int volume;
+} shadow = { IPAddress(), "", -1 };
+
+static WiFiServer eventServer(SONOS_EVENT_PORT);
+static boolean listening = false;
+
+static boolean isLive(Subscription *sub) {
+    return sub->sid[0] != '\0' && (long) (sub->expires - millis()) > 0;
+}
+
+/*
+ * The NOTIFY body is a propertyset wrapping an escaped LastChange document like this:
+ *   <Event xmlns="urn:schemas-upnp-org:metadata-1-0/AVT/">
+ *     <InstanceID val="0">
+ *       <TransportState val="PLAYING"/>
+ *       ...
+ *     </InstanceID>
+ *   </Event>
+ * expat hands us the unescaped LastChange text as character data, which we feed straight into a
+ * second parser rather than collecting it all first.
+ */
+static void lastChangeStart(void *data, const char *el, const char **attr) {
+    const char *name = xmlLocalName(el);
+    if (strcmp(name, "TransportState") == 0) {
+        const char *val = xmlAttrValue(attr, "val");
+        if (val != NULL) {
+            strncpy(shadow.transportState, val, sizeof(shadow.transportState) - 1);
+            shadow.transportState[sizeof(shadow.transportState) - 1] = '\0';
+        }
+    } else if (strcmp(name, "Volume") == 0) {
+        const char *channel = xmlAttrValue(attr, "channel");
+        const char *val = xmlAttrValue(attr, "val");
+        if (channel != NULL && val != NULL && strcmp(channel, "Master") == 0) {
+            shadow.volume = atoi(val);
+        }
+    }
+}
+
+static void propertyStart(void *data, const char *el, const char **attr) {
+    XML_Parser *inner = (XML_Parser *) data;
+    if (*inner == NULL && strcmp(xmlLocalName(el), "LastChange") == 0) {
+        *inner = XML_ParserCreate(NULL);
+        if (*inner == NULL) {
+            Serial.println("Couldn't allocate parser");
+            return;
+        }
+        XML_SetElementHandler(*inner, lastChangeStart, NULL);
+    }
+}
+
+static void propertyEnd(void *data, const char *el) {
+    XML_Parser *inner = (XML_Parser *) data;
+    if (*inner != NULL && strcmp(xmlLocalName(el), "LastChange") == 0) {
+        XML_Parse(*inner, "", 0, true);
+        XML_ParserFree(*inner);
+        *inner = NULL;
+    }
+}
+
+static void propertyData(void *data, const char *s, int len) {
+    XML_Parser *inner = (XML_Parser *) data;
+    if (*inner != NULL) {
+        XML_Parse(*inner, s, len, false);
+    }
+}
+
+// Wait for more of a NOTIFY to arrive, asleep in select rather than spinning. Returns false if the player closed the
+// socket or deadline went by first
+static boolean waitForData(WiFiClient &client, unsigned long deadline) {
+    while (!client.available()) {
+        long left = (long) (deadline - millis());
+        if (left <= 0 || !client.connected() || client.fd() < 0) {
+            return false;
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(client.fd(), &fds);
+        struct timeval wait = { left / 1000, (left % 1000) * 1000 };
+        if (lwip_select(client.fd() + 1, &fds, NULL, NULL, &wait) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int readLine(WiFiClient &client, char *buf, size_t len, unsigned long deadline) {
+    size_t pos = 0;
+    for (;;) {
+        if (!waitForData(client, deadline)) {
+            return -1;
+        }
+        int c = client.read();
+        if (c == '\n') {
+            break;
+        }
+        if (c != '\r' && pos < len - 1) {
+            buf[pos++] = c;
+        }
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+typedef struct {
+    WiFiClient *client;
+    // Bytes of the body still to come, -1 if it runs until the socket closes
+    int remaining;
+    unsigned long deadline;
+} NotifyBody;
+
+// The next piece of a NOTIFY's body, an XmlSource
+static int readBody(void *source, char *buf, size_t len) {
+    NotifyBody *body = (NotifyBody *) source;
+    if (body->remaining == 0) {
+        return 0;
+    }
+    if (!waitForData(*body->client, body->deadline)) {
+        return -1;
+    }
+    size_t wanted = (body->remaining > 0 && body->remaining < (int) len) ? body->remaining : len;
+    int count = body->client->read((uint8_t *) buf, wanted);
+    if (count > 0 && body->remaining > 0) {
+        body->remaining -= count;
+    }
+    return count;
+}
+
+static void handleNotify(WiFiClient &client) {
+    unsigned long deadline = millis() + SONOS_NOTIFY_TIMEOUT_MS;
+    char line[128];
+    char sid[64] = "";
+    int contentLength = -1;
+
+    // NOTIFY /avt HTTP/1.1
+    if (readLine(client, line, sizeof(line), deadline) <= 0 || strncmp(line, "NOTIFY ", 7) != 0) {
+        client.stop();
+        return;
+    }
+    for (;;) {
+        int len = readLine(client, line, sizeof(line), deadline);
+        if (len < 0) {
+            client.stop();
+            return;
+        }
+        if (len == 0) {
+            break;
+        }
+        if (strncasecmp(line, "SID:", 4) == 0) {
+            const char *value = line + 4;
+            while (*value == ' ') {
+                value++;
+            }
+            strncpy(sid, value, sizeof(sid) - 1);
+            sid[sizeof(sid) - 1] = '\0';
+        } else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            contentLength = atoi(line + 15);
+        }
+    }
+
+    Subscription *sub = NULL;
+    for (uint8_t i = 0; i < NUM_SUBSCRIPTIONS; i++) {
+        if (subscriptions[i].sid[0] != '\0' && strcmp(subscriptions[i].sid, sid) == 0) {
+            sub = &subscriptions[i];
+        }
+    }
+    if (sub == NULL) {
+        // Probably a leftover subscription from before we slept, the player drops it on a 412
+        client.print("HTTP/1.1 412 Precondition Failed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+        client.stop();
+        return;
+    }
+
+    NotifyBody body = { &client, contentLength, deadline };
+    XML_Parser inner = NULL;
+    XML_Parser p = NULL;
+    if (sub == ZGT_SUBSCRIPTION) {
+        // The whole household's ZoneGroupState, it goes straight into the topology so transport actions find the
+        // coordinators where they are now
+        sonosTopologyEvent(readBody, &body);
+    } else if ((p = XML_ParserCreate(NULL)) == NULL) {
+        Serial.println("Couldn't allocate parser");
+    } else {
+        XML_SetUserData(p, &inner);
+        XML_SetElementHandler(p, propertyStart, propertyEnd);
+        XML_SetCharacterDataHandler(p, propertyData);
+
+        char buf[256];
+        int count;
+        while ((count = readBody(&body, buf, sizeof(buf))) > 0) {
+            XML_Parse(p, buf, count, false);
+        }
+        XML_Parse(p, "", 0, true);
+        if (inner != NULL) {
+            XML_ParserFree(inner);
+        }
+        XML_ParserFree(p);
+    }
+
+    client.print("HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    client.stop();
+    Serial.printf("Event on %s, state %s volume %d\n", sub->callbackPath, shadow.transportState, shadow.volume);
+}
+
+static void subscribe(Subscription *sub, IPAddress player) {
+    EnergyScope radio(ENERGY_HTTP);
+    char headers[160];
+    if (sub->sid[0] != '\0') {
+        snprintf(headers, sizeof(headers), "SID: %s\r\nTIMEOUT: Second-%d\r\n", sub->sid, SONOS_SUBSCRIPTION_SECONDS);
+    } else {
+        snprintf(headers, sizeof(headers), "CALLBACK: <http://%s:%d%s>\r\nNT: upnp:event\r\nTIMEOUT: Second-%d\r\n",
+            WiFi.localIP().toString().c_str(), SONOS_EVENT_PORT, sub->callbackPath, SONOS_SUBSCRIPTION_SECONDS);
+    }
+    sub->lastAttempt = millis();
+
+    char sid[64];
+    SonosConnection *conn = sonosConnection(player);
+    conn->captureHeader("SID", sid, sizeof(sid));
+    int httpCode = conn->request("SUBSCRIBE", sub->eventPath, headers, "", 0);
+    conn->finish();
+
+    if (httpCode == 200 && sid[0] != '\0') {
+        if (strcmp(sub->sid, sid) != 0) {
+            // A new subscription, wait for its initial event rather than trusting what we had
+            if (sub == AVT_SUBSCRIPTION) {
+                shadow.transportState[0] = '\0';
+            } else if (sub == RC_SUBSCRIPTION) {
+                shadow.volume = -1;
+            }
+        }
+        strcpy(sub->sid, sid);
+        sub->expires = millis() + SONOS_SUBSCRIPTION_SECONDS * 1000UL;
+    } else {
+        // A failed renewal means the player forgot us, start over with a fresh subscription next time
+        Serial.printf("Couldn't subscribe to %s: %d\n", sub->eventPath, httpCode);
+        sub->sid[0] = '\0';
+        sub->expires = 0;
+    }
+}
+
+// Take the NOTIFY requests that have come in since we last looked
+static void handlePending() {
+    WiFiClient client = eventServer.available();
+    while (client) {
+        handleNotify(client);
+        client = eventServer.available();
+    }
+}
+
+void sonosEventsBegin() {
+    if (!listening) {
+        eventServer.begin();
+        listening = true;
+    }
+}
+
+void sonosEventsPoll(IPAddress player) {
+    if (!listening || !player) {
+        return;
+    }
+    MemoryScope memory(MEM_OP_EVENTS);
+    if (shadow.player != player) {
+        // New target, whatever we knew about the old one is useless
+        for (uint8_t i = 0; i < NUM_SUBSCRIPTIONS; i++) {
+            subscriptions[i].sid[0] = '\0';
+            subscriptions[i].expires = 0;
+            subscriptions[i].lastAttempt = 0;
+        }
+        shadow.player = player;
+        shadow.transportState[0] = '\0';
+        shadow.volume = -1;
+    }
+
+    handlePending();
+
+    for (uint8_t i = 0; i < NUM_SUBSCRIPTIONS; i++) {
+        Subscription *sub = &subscriptions[i];
+        if (sub->sid[0] == '\0') {
+            if (sub->lastAttempt == 0 || millis() - sub->lastAttempt > SONOS_SUBSCRIBE_RETRY_MS) {
+                subscribe(sub, player);
+            }
+        } else if ((long) (sub->expires - millis()) < SONOS_RENEW_MARGIN_MS) {
+            subscribe(sub, player);
+        }
+    }
+}
+
+void sonosEventsEnd() {
+    EnergyScope radio(ENERGY_HTTP);
+    for (uint8_t i = 0; i < NUM_SUBSCRIPTIONS; i++) {
+        Subscription *sub = &subscriptions[i];
+        if (isLive(sub)) {
+            char headers[80];
+            snprintf(headers, sizeof(headers), "SID: %s\r\n", sub->sid);
+            SonosConnection *conn = sonosConnection(shadow.player);
+            conn->request("UNSUBSCRIBE", sub->eventPath, headers, "", 0);
+            conn->finish();
+        }
+        sub->sid[0] = '\0';
+        sub->expires = 0;
+        sub->lastAttempt = 0;
+    }
+    shadow.player = IPAddress();
+    if (listening) {
+        eventServer.end();
+        listening = false;
+    }
+}
+
+const char *sonosShadowTransportState(IPAddress player) {
+    if (player != shadow.player || !isLive(AVT_SUBSCRIPTION) || shadow.transportState[0] == '\0') {
+        return NULL;
+    }
+    return shadow.transportState;
+}
+
+int sonosShadowVolume(IPAddress player) {
+    if (player != shadow.player || !isLive(RC_SUBSCRIPTION)) {
+        return -1;
+    }
+    return shadow.volume;
+}
+
+void sonosShadowTransportChanged(IPAddress player, const char *state) {
+    if (player == shadow.player) {
+        strncpy(shadow.transportState, state, sizeof(shadow.transportState) - 1);
+        shadow.transportState[sizeof(shadow.transportState) - 1] = '\0';
+    }
+}
+
+void sonosEventsCatchUp() {
+    if (!listening) {
+        return;
+    }
+    MemoryScope memory(MEM_OP_EVENTS);
+    handlePending();
+}
+
+void sonosShadowVolumeChanged(IPAddress player, int volume) {
+    if (player == shadow.player && shadow.volume >= 0) {
+        shadow.volume = volume;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Port our NOTIFY listener runs on, the same one the sonos controller apps use
+#define SONOS_EVENT_PORT 3400
+// How long we ask the player to keep each subscription alive, in seconds
+#define SONOS_SUBSCRIPTION_SECONDS 600
+// Renew this long before a subscription runs out
+#define SONOS_RENEW_MARGIN_MS 60000
+// Don't hammer a player that refuses our subscriptions
+#define SONOS_SUBSCRIBE_RETRY_MS 10000
+// Most a NOTIFY can take to come in. They're handled on the command task, so a slow or half-open sender mustn't
+// hold up the presses for long
+#define SONOS_NOTIFY_TIMEOUT_MS 300
+
+/**
+ * UPnP GENA eventing for the AVTransport, RenderingControl and ZoneGroupTopology services.
+ *
+ * While we're awake we keep a subscription to each service on the target player and a local
+ * shadow of its transport state and volume, fed by the LastChange events it NOTIFYs us with. The
+ * operations read the shadow instead of paying a round trip for GetTransportInfo/GetVolume, and
+ * only fall back to asking the player when the shadow isn't backed by a live subscription. The
+ * topology events carry the whole household's ZoneGroupState, which replaces the topology we keep
+ * so the coordinators transport actions go to follow the groups as they change.
+ */
+
+// Start the NOTIFY listener, needs wifi to be up
+void sonosEventsBegin();
+
+// Subscribe to or renew subscriptions on player and handle any pending NOTIFY requests.
+// Cheap enough to call on every idle loop.
+void sonosEventsPoll(IPAddress player);
+
+// Drop our subscriptions and stop the listener before going to sleep
+void sonosEventsEnd();
+
+// The shadowed transport state (PLAYING, PAUSED_PLAYBACK, STOPPED...) or NULL if it's stale
+const char *sonosShadowTransportState(IPAddress player);
+
+// The shadowed master volume, or -1 if it's stale
+int sonosShadowVolume(IPAddress player);
+
+// Handle the NOTIFY requests that have already come in, without subscribing or renewing anything. Costs no round
+// trip, so it can go right before a command that depends on what they say
+void sonosEventsCatchUp();
+
+// Let the shadow know about changes we made ourselves so we don't race the player's event
+void sonosShadowTransportChanged(IPAddress player, const char *state);
+void sonosShadowVolumeChanged(IPAddress player, int volume);
@@ -0,0 +1,194 @@
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <string.h>
+#include "sonos_memory.h"
+
+typedef struct {
+    const char *name;
+    // Most one call may allocate on a socket that's already open
+    uint16_t allocations;
+    uint32_t bytes;
+} MemoryBudget;
+
+// Parsing a response with expat costs about 7 allocations, everything else on the request path is on the stack
+static const MemoryBudget BUDGETS[MEM_OPS] = {
+    { "play/pause", 8, 320 },
+    { "skip", 0, 0 },
+    { "volume", 8, 320 },
+    { "volume ramp", 8, 320 },
+    { "fan-out", 8, 320 },
+    { "topology", 48, 1536 },
+    { "discovery", 56, 2048 },
+    { "events", 16, 1024 }
+};
+
+typedef struct {
+    MemoryOp op;
+    uint16_t allocations;
+    uint32_t bytes;
+    uint16_t allowedAllocations;
+    uint32_t allowedBytes;
+    size_t freeBefore;
+} MemoryFrame;
+
+static MemoryStats stats[MEM_OPS];
+static MemoryFrame frames[MEMORY_NEST_MAX];
+static volatile uint8_t depth = 0;
+// Operations nested deeper than we have frames for, they're left out
+static uint8_t overflow = 0;
+// Only allocations made by the task running the operations count
+static TaskHandle_t owner = NULL;
+
+static TaskHandle_t watched[MEMORY_TASKS_MAX];
+static uint8_t watchedCount = 0;
+
+// Raise the budgets of the operations running
+static void allowMore(uint16_t allocations, uint32_t bytes) {
+    for (uint8_t i = 0; i < depth; i++) {
+        frames[i].allowedAllocations += allocations;
+        frames[i].allowedBytes += bytes;
+    }
+}
+
+void memoryOpStart(MemoryOp op, uint8_t times) {
+    if (depth == 0) {
+        owner = xTaskGetCurrentTaskHandle();
+    }
+    if (xTaskGetCurrentTaskHandle() != owner) {
+        return;
+    }
+    if (depth >= MEMORY_NEST_MAX) {
+        overflow++;
+        return;
+    }
+    MemoryFrame *frame = &frames[depth];
+    frame->op = op;
+    frame->allocations = 0;
+    frame->bytes = 0;
+    frame->allowedAllocations = BUDGETS[op].allocations * times;
+    frame->allowedBytes = BUDGETS[op].bytes * times;
+    frame->freeBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    // What the nested operation may spend counts against the ones around it too, so they may spend it as well
+    allowMore(frame->allowedAllocations, frame->allowedBytes);
+    depth++;
+}
+
+void memoryOpEnd() {
+    if (depth == 0 || xTaskGetCurrentTaskHandle() != owner) {
+        return;
+    }
+    if (overflow > 0) {
+        overflow--;
+        return;
+    }
+    depth--;
+    const MemoryFrame &frame = frames[depth];
+    MemoryStats *stat = &stats[frame.op];
+    stat->calls++;
+    if (stat->calls == 1) {
+        stat->firstAllocations = frame.allocations;
+        stat->firstBytes = frame.bytes;
+        // The first call isn't held to its budget, so the operations around it aren't held to it either
+        allowMore(frame.allocations > frame.allowedAllocations ? frame.allocations - frame.allowedAllocations : 0,
+            frame.bytes > frame.allowedBytes ? frame.bytes - frame.allowedBytes : 0);
+    } else {
+        if (frame.allocations > stat->maxAllocations) {
+            stat->maxAllocations = frame.allocations;
+        }
+        if (frame.bytes > stat->maxBytes) {
+            stat->maxBytes = frame.bytes;
+        }
+    }
+    int32_t held = (int32_t) frame.freeBefore - (int32_t) heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (held > stat->maxHeld) {
+        stat->maxHeld = held;
+    }
+    uint32_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    if (stat->calls == 1 || largest < stat->minLargestBlock) {
+        stat->minLargestBlock = largest;
+    }
+    if (stat->calls > 1 && (frame.allocations > frame.allowedAllocations || frame.bytes > frame.allowedBytes)) {
+        stat->overBudget++;
+        Serial.printf("%s went over its memory budget: %u allocations of %u, %u bytes of %u\n", BUDGETS[frame.op].name,
+            frame.allocations, frame.allowedAllocations, (unsigned int) frame.bytes, (unsigned int) frame.allowedBytes);
+    }
+}
+
+void memoryConnectionOpened() {
+    allowMore(MEMORY_CONNECT_ALLOCATIONS, MEMORY_CONNECT_BYTES);
+}
+
+void memoryCountAllocation(size_t size) {
+    if (depth == 0 || xTaskGetCurrentTaskHandle() != owner) {
+        return;
+    }
+    for (uint8_t i = 0; i < depth; i++) {
+        frames[i].allocations++;
+        frames[i].bytes += size;
+    }
+}
+
+void memoryWatchTask(TaskHandle_t task) {
+    if (watchedCount < MEMORY_TASKS_MAX) {
+        watched[watchedCount++] = task;
+    }
+}
+
+const MemoryStats &memoryStats(MemoryOp op) {
+    return stats[op];
+}
+
+uint32_t memoryOverBudget() {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < MEM_OPS; i++) {
+        total += stats[i].overBudget;
+    }
+    return total;
+}
+
+void memoryDump() {
+    Serial.printf("Memory per operation, the worst call against the budget for one player or reply\n");
+    Serial.printf("  %-12s %6s %11s %13s %12s %6s %8s %5s\n", "operation", "calls", "allocs", "bytes", "first call", "held", "largest", "over");
+    for (uint8_t i = 0; i < MEM_OPS; i++) {
+        const MemoryStats &stat = stats[i];
+        if (stat.calls == 0) {
+            Serial.printf("  %-12s %6s\n", BUDGETS[i].name, "-");
+            continue;
+        }
+        Serial.printf("  %-12s %6u %5u/%-5u %6u/%-6u %4u/%-7u %6d %8u %5u\n", BUDGETS[i].name, (unsigned int) stat.calls,
+            stat.maxAllocations, BUDGETS[i].allocations, (unsigned int) stat.maxBytes, (unsigned int) BUDGETS[i].bytes,
+            stat.firstAllocations, (unsigned int) stat.firstBytes, (int) stat.maxHeld, (unsigned int) stat.minLargestBlock, (unsigned int) stat.overBudget);
+    }
+    Serial.printf("Free heap %u, lowest %u, largest free block %u\n", (unsigned int) heap_caps_get_free_size(MALLOC_CAP_8BIT),
+        (unsigned int) heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT), (unsigned int) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+    for (uint8_t i = 0; i < watchedCount; i++) {
+        // Stacks are counted in bytes on the ESP32
+        unsigned int left = uxTaskGetStackHighWaterMark(watched[i]);
+        Serial.printf("Stack left at its deepest in %s: %u%s\n", pcTaskGetTaskName(watched[i]), left,
+            left < MEMORY_STACK_LOW_BYTES ? ", too close" : "");
+    }
+}
+
+#ifdef ESP_PLATFORM
+// Everything that allocates goes through these once the link wraps malloc, see component.mk
+extern "C" {
+    void *__real_malloc(size_t size);
+    void *__real_calloc(size_t count, size_t size);
+    void *__real_realloc(void *ptr, size_t size);
+
+    void *__wrap_malloc(size_t size) {
+        memoryCountAllocation(size);
+        return __real_malloc(size);
+    }
+
+    void *__wrap_calloc(size_t count, size_t size) {
+        memoryCountAllocation(count * size);
+        return __real_calloc(count, size);
+    }
+
+    void *__wrap_realloc(void *ptr, size_t size) {
+        memoryCountAllocation(size);
+        return __real_realloc(ptr, size);
+    }
+}
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Arduino.h>
+
+// How deep operations can nest, a discovery reads the topology inside it
+#define MEMORY_NEST_MAX 4
+// Most tasks we keep an eye on the stacks of
+#define MEMORY_TASKS_MAX 4
+// Complain about a task that has come within this many bytes of the end of its stack
+#define MEMORY_STACK_LOW_BYTES 512
+// What opening a socket costs on top of an operation's budget, lwip's netconn and pcb and the SYN going out
+#define MEMORY_CONNECT_ALLOCATIONS 4
+#define MEMORY_CONNECT_BYTES 1024
+
+// The operations we keep memory numbers for, each with a budget in sonos_memory.cpp
+typedef enum {
+    MEM_OP_PLAY,
+    MEM_OP_SKIP,
+    MEM_OP_VOLUME,
+    MEM_OP_RAMP,
+    MEM_OP_FANOUT,
+    MEM_OP_TOPOLOGY,
+    MEM_OP_DISCOVERY,
+    MEM_OP_EVENTS,
+    MEM_OPS
+} MemoryOp;
+
+typedef struct {
+    uint32_t calls;
+    // What the first call allocated. It sets up parsers and buffers the later calls reuse, so it isn't held to the budget
+    uint16_t firstAllocations;
+    uint32_t firstBytes;
+    // The most any later call allocated
+    uint16_t maxAllocations;
+    uint32_t maxBytes;
+    // The most free heap went down over a call, either kept by the call or by something running alongside it
+    int32_t maxHeld;
+    // The smallest the largest free block has been after a call, which is how fragmented the heap is getting
+    uint32_t minLargestBlock;
+    // Calls that went over their budget
+    uint32_t overBudget;
+} MemoryStats;
+
+/**
+ * Heap and stack telemetry for the command path.
+ *
+ * Every allocation made by the task running an operation is counted against it, and against any
+ * operations it's nested inside, whose budgets grow by the nested one's. On the device malloc is
+ * wrapped at link time to do the counting, on the host the benchmark's malloc does it. A call that
+ * allocates more than its operation's budget gets logged, and the host benchmark fails when any
+ * did. Free heap, the largest free block and the stack high water marks of the tasks we're
+ * watching come out of memoryDump().
+ */
+
+// Start counting for op, the budget is multiplied by times for operations that do the same thing to several players
+void memoryOpStart(MemoryOp op, uint8_t times = 1);
+
+// Finish the innermost operation and check it against its budget, unless it's the first call
+void memoryOpEnd();
+
+// A socket was opened, the operations running get MEMORY_CONNECT_* more to spend
+void memoryConnectionOpened();
+
+// Called for every allocation
+void memoryCountAllocation(size_t size);
+
+// Keep track of how close task gets to the end of its stack
+void memoryWatchTask(TaskHandle_t task);
+
+const MemoryStats &memoryStats(MemoryOp op);
+
+// How many calls went over their budget
+uint32_t memoryOverBudget();
+
+// Print everything over serial
+void memoryDump();
+
+// Counts against op from here to the end of the scope
+class MemoryScope {
+    public:
+        MemoryScope(MemoryOp op, uint8_t times = 1) { memoryOpStart(op, times); }
+        ~MemoryScope() { memoryOpEnd(); }
+};
@@ -0,0 +1,140 @@
+#include <Arduino.h>
+#include <string.h>
+#include "sonos.h"
+#include "sonos_rtt.h"
+
+#define RTT_MAGIC 0x52545430
+
+typedef struct {
+    uint32_t address;
+    // The smoothed round trip in ms scaled by 8 and its mean deviation scaled by 4, the way BSD's TCP keeps them
+    int32_t srtt8;
+    int32_t rttvar4;
+    uint16_t samples;
+    // How many times the connect timeout is doubled since the player last answered in time
+    uint8_t backoff;
+    // When we last heard from it, so the least recently measured player can make way
+    uint32_t lastSample;
+} PlayerRtt;
+
+static RTC_DATA_ATTR struct {
+    uint32_t magic;
+    uint32_t sequence;
+    PlayerRtt players[SONOS_RTT_PLAYERS];
+    uint32_t hedges;
+    uint32_t hedgesWon;
+} rtt;
+
+static void checkTable() {
+    if (rtt.magic != RTT_MAGIC) {
+        memset(&rtt, 0, sizeof(rtt));
+        rtt.magic = RTT_MAGIC;
+    }
+}
+
+// The entry for player, NULL if we haven't measured it unless create is set
+static PlayerRtt *findPlayer(IPAddress player, boolean create) {
+    checkTable();
+    uint32_t address = (uint32_t) player;
+    PlayerRtt *oldest = &rtt.players[0];
+    for (uint8_t i = 0; i < SONOS_RTT_PLAYERS; i++) {
+        if (rtt.players[i].address == address) {
+            return &rtt.players[i];
+        }
+        if (rtt.players[i].lastSample < oldest->lastSample) {
+            oldest = &rtt.players[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->address = address;
+    return oldest;
+}
+
+void sonosRttSample(IPAddress player, uint32_t ms) {
+    PlayerRtt *entry = findPlayer(player, true);
+    int32_t measured = ms;
+    if (entry->samples == 0) {
+        entry->srtt8 = measured << 3;
+        entry->rttvar4 = measured << 1;
+    } else {
+        // srtt += (measured - srtt) / 8, rttvar += (|measured - srtt| - rttvar) / 4
+        int32_t error = measured - (entry->srtt8 >> 3);
+        entry->srtt8 += error;
+        if (error < 0) {
+            error = -error;
+        }
+        entry->rttvar4 += error - (entry->rttvar4 >> 2);
+    }
+    if (entry->samples < UINT16_MAX) {
+        entry->samples++;
+    }
+    entry->backoff = 0;
+    entry->lastSample = ++rtt.sequence;
+}
+
+void sonosRttTimedOut(IPAddress player) {
+    PlayerRtt *entry = findPlayer(player, false);
+    if (entry != NULL && entry->backoff < SONOS_RTT_MAX_BACKOFF) {
+        entry->backoff++;
+    }
+}
+
+static uint32_t timeoutAtLeast(IPAddress player, int32_t floor, boolean backOff) {
+    PlayerRtt *entry = findPlayer(player, false);
+    if (entry == NULL || entry->samples == 0) {
+        return HTTP_TIMEOUT;
+    }
+    uint32_t timeout = constrain((entry->srtt8 >> 3) + entry->rttvar4, floor, HTTP_TIMEOUT);
+    if (backOff) {
+        timeout <<= entry->backoff;
+    }
+    return timeout < HTTP_TIMEOUT ? timeout : HTTP_TIMEOUT;
+}
+
+uint32_t sonosRttTimeout(IPAddress player) {
+    // Already most of HTTP_TIMEOUT, doubling it would just pin it there
+    return timeoutAtLeast(player, SONOS_RTT_MIN_TIMEOUT_MS, false);
+}
+
+uint32_t sonosRttConnectTimeout(IPAddress player) {
+    return timeoutAtLeast(player, SONOS_RTT_MIN_CONNECT_MS, true);
+}
+
+uint32_t sonosRttHedgeAfter(IPAddress player) {
+    PlayerRtt *entry = findPlayer(player, false);
+    if (entry == NULL || entry->samples == 0) {
+        return SONOS_HEDGE_DEFAULT_MS;
+    }
+    uint32_t after = (entry->srtt8 >> 3) + (entry->rttvar4 >> 1);
+    if (after < SONOS_HEDGE_MIN_MS) {
+        after = SONOS_HEDGE_MIN_MS;
+    }
+    uint32_t timeout = sonosRttTimeout(player);
+    return after < timeout ? after : timeout;
+}
+
+void sonosRttHedged(boolean backupWon) {
+    checkTable();
+    rtt.hedges++;
+    if (backupWon) {
+        rtt.hedgesWon++;
+    }
+}
+
+void sonosRttDump() {
+    checkTable();
+    Serial.printf("Round trips, %u hedged requests and the backup won %u of them:\n", (unsigned int) rtt.hedges, (unsigned int) rtt.hedgesWon);
+    for (uint8_t i = 0; i < SONOS_RTT_PLAYERS; i++) {
+        const PlayerRtt &entry = rtt.players[i];
+        if (entry.samples == 0) {
+            continue;
+        }
+        IPAddress player(entry.address);
+        Serial.printf("  %-15s %4dms +-%-4d timeout %4ums hedge after %4ums, %u samples\n", player.toString().c_str(),
+            (int) (entry.srtt8 >> 3), (int) (entry.rttvar4 >> 2), (unsigned int) sonosRttTimeout(player),
+            (unsigned int) sonosRttHedgeAfter(player), entry.samples);
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Players we keep round trip times for, the least recently measured one makes way for a new one
+#define SONOS_RTT_PLAYERS 8
+// Bounds on a timeout worked out from the round trips, a healthy player answers in about 30ms. A request
+// gets longer than lwip's smallest retransmission timeout (1s) and some, so one lost segment gets resent
+// before we give up on the player. That leaves requests between this and HTTP_TIMEOUT whatever the round
+// trips are, it's the connect timeout and the hedge time that follow them
+#define SONOS_RTT_MIN_TIMEOUT_MS 1500
+// Connecting can give up sooner, lwip waits 3s to resend a lost SYN and a fresh connect is quicker than that
+#define SONOS_RTT_MIN_CONNECT_MS 250
+// The most times the connect timeout gets doubled after the player missed a deadline
+#define SONOS_RTT_MAX_BACKOFF 3
+// When to send a hedged request to a player we haven't measured yet
+#define SONOS_HEDGE_DEFAULT_MS 500
+// Never hedge sooner than this, the backup would just add load to a healthy network
+#define SONOS_HEDGE_MIN_MS 30
+
+/**
+ * Round trip times to each player, for connect timeouts and hedging that follow the network instead
+ * of a constant.
+ *
+ * A smoothed round trip and its mean deviation are kept per player the way TCP does (RFC 6298),
+ * timed from a request going out to its response headers coming back, so they include the
+ * player's own time to answer. They're in RTC memory so a wake from deep sleep starts with what we
+ * had learned. Players we have nothing on get HTTP_TIMEOUT. Request timeouts have to outlast a TCP
+ * retransmission, so they only move off their floor for a player slower than that.
+ */
+
+// A request to player took ms to be answered
+void sonosRttSample(IPAddress player, uint32_t ms);
+
+// A connect or request to player went unanswered until its timeout, so back off its next connect
+void sonosRttTimedOut(IPAddress player);
+
+// How long to give player to answer, the smoothed round trip plus four deviations but at least SONOS_RTT_MIN_TIMEOUT_MS
+uint32_t sonosRttTimeout(IPAddress player);
+// The same for connecting, with a lower floor and doubled for each deadline missed since the player last answered
+uint32_t sonosRttConnectTimeout(IPAddress player);
+
+// When a request to player is later than about 95 in 100 of them are, two deviations past the smoothed round trip
+uint32_t sonosRttHedgeAfter(IPAddress player);
+
+// A hedged request went out, and whether the backup beat the primary
+void sonosRttHedged(boolean backupWon);
+
+// Print what we know about every player over serial
+void sonosRttDump();
@@ -0,0 +1,74 @@
+#include <Arduino.h>
+#include <string>
+#include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_target.h"
+#include "sonos_topology.h"
+#include "sonos_trace.h"
+
+static std::string targetUid;
+static IPAddress targetSonos;
+static void (*unreachable)() = NULL;
+
+void sonosTargetBegin(const char *uid, void (*onUnreachable)()) {
+    targetUid = uid;
+    targetSonos = IPAddress();
+    unreachable = onUnreachable;
+}
+
+IPAddress sonosTarget() {
+    return targetSonos;
+}
+
+void findTargetSonos() {
+    sonosTopologyLoad();
+    targetSonos = sonosTopologyAddress(targetUid.c_str());
+    if (targetSonos) {
+        Serial.printf("Using cached sonos IP %s\n", targetSonos.toString().c_str());
+    } else {
+        targetSonos = discoverSonos(targetUid);
+    }
+}
+
+void lostTarget() {
+    // Ask the rest of the household where the player went before falling back to rediscovering
+    targetSonos = sonosTopologyRecover(targetUid.c_str());
+    if (!targetSonos) {
+        targetSonos = discoverSonos(targetUid);
+    }
+    if (!targetSonos && unreachable != NULL) {
+        unreachable();
+    }
+}
+
+int doSonos(SonosOperation operation, int amount, boolean cancellable, int *result) {
+    *result = -1;
+    traceMark(TRACE_COMMAND);
+    if (!targetSonos) {
+        targetSonos = discoverSonos(targetUid);
+    }
+    if (!targetSonos) {
+        Serial.println("Couldn't find the right sonos, bailing");
+        return ENO_CANTCONNECT;
+    }
+
+    if (cancellable) {
+        sonosCancelBegin();
+    }
+    int error = sonosOperation(operation, targetSonos, amount, result);
+    sonosCancelEnd();
+    // Any other error came from a player that answered or is just slow to, so looking for it somewhere else won't help
+    if (error == ENO_CANTCONNECT) {
+        lostTarget();
+        // The press needn't be lost with the old address if nothing got to it, try once more where the player is now
+        if (targetSonos && sonosOperationUnsent()) {
+            Serial.printf("Sending it again to %s\n", targetSonos.toString().c_str());
+            if (cancellable) {
+                sonosCancelBegin();
+            }
+            error = sonosOperation(operation, targetSonos, amount, result);
+            sonosCancelEnd();
+        }
+    }
+    return error;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+#include "sonos.h"
+
+/**
+ * The player the buttons control, and getting presses to it when it moves.
+ *
+ * Its address comes from the topology saved in RTC memory, or from discovery when that doesn't know
+ * it. When it can't be reached the rest of the household gets asked where it went before we
+ * discover it all over again, and a press that never got out goes once more to wherever it is now.
+ * The command task sends every press through here, and so do the host's end to end runs.
+ */
+
+// Control the player uid from now on, forgetting where the last one was. unreachable gets called when neither the
+// household nor discovery can find it, so maybe it's us that's in the wrong place. It can be NULL
+void sonosTargetBegin(const char *uid, void (*unreachable)());
+
+// Where the player is, 0.0.0.0 if we don't know
+IPAddress sonosTarget();
+
+// Find the player from the topology we saved last time, or discover it if we don't know it
+void findTargetSonos();
+
+// The player stopped answering, find out where it went for next time
+void lostTarget();
+
+// Second layer of sonos operation wrapper to handle the rediscovery logic. Returns the operation's error and
+// puts what the player reported back in result, or -1. Only the operation itself can be cancelled, never
+// the discovery around it
+int doSonos(SonosOperation operation, int amount, boolean cancellable, int *result);
@@ -0,0 +1,256 @@
+#include <Arduino.h>
+#include <Preferences.h>
+#include <string.h>
+#include "sonos.h"
+#include "sonos_connection.h"
+#include "sonos_topology.h"
+#include "sonos_memory.h"
+#include "energy.h"
+#include "sonos_xml.h"
+#include "soap.h"
+
+#define TOPOLOGY_MAGIC 0x50707053
+
+static RTC_DATA_ATTR Topology topology;
+// TOPOLOGY_MAGIC ^ topology.hash when the RTC copy is good
+static RTC_DATA_ATTR uint32_t topology_check;
+
+// Scratch for reading a new topology, too big to want on the stack
+static Topology fresh;
+static char freshCoordinators[SONOS_TOPOLOGY_MAX][SONOS_UUID_LEN];
+
+static constexpr SoapAction GET_ZONE_GROUP_STATE = SOAP_ACTION("/ZoneGroupTopology/Control", "ZoneGroupTopology", "GetZoneGroupState", "");
+
+// FNV-1a over everything but the hash itself
+static uint32_t topologyHash(const Topology &t) {
+    uint32_t hash = 2166136261u;
+    const uint8_t *p = (const uint8_t *) &t.count;
+    const uint8_t *end = (const uint8_t *) &t.players[t.count];
+    for (; p < end; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static int findPlayer(const Topology &t, const char *uuid) {
+    for (uint8_t i = 0; i < t.count; i++) {
+        if (strcmp(t.players[i].uuid, uuid) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int findAddress(IPAddress player) {
+    for (uint8_t i = 0; i < topology.count; i++) {
+        if (topology.players[i].addresses[0] == (uint32_t) player) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Rehash the map after changing it and keep it in flash too
+static void saveTopology() {
+    topology.hash = topologyHash(topology);
+    topology_check = TOPOLOGY_MAGIC ^ topology.hash;
+    Preferences prefs;
+    prefs.begin("sonos");
+    prefs.putBytes("topology", &topology, sizeof(topology));
+    prefs.end();
+}
+
+void sonosTopologyLoad() {
+    if (topology.count <= SONOS_TOPOLOGY_MAX && topology_check == (TOPOLOGY_MAGIC ^ topology.hash)
+            && topologyHash(topology) == topology.hash) {
+        return;
+    }
+
+    Preferences prefs;
+    prefs.begin("sonos", true);
+    size_t len = prefs.getBytes("topology", &topology, sizeof(topology));
+    prefs.end();
+    if (len != sizeof(topology) || topology.count > SONOS_TOPOLOGY_MAX || topologyHash(topology) != topology.hash) {
+        Serial.println("No stored sonos topology");
+        memset(&topology, 0, sizeof(topology));
+        topology.hash = topologyHash(topology);
+    } else {
+        Serial.printf("Loaded sonos topology with %d players from flash\n", topology.count);
+    }
+    topology_check = TOPOLOGY_MAGIC ^ topology.hash;
+}
+
+IPAddress sonosTopologyAddress(const char *uuid) {
+    int i = findPlayer(topology, uuid);
+    return i < 0 ? IPAddress() : IPAddress(topology.players[i].addresses[0]);
+}
+
+IPAddress sonosTopologyCoordinator(IPAddress player) {
+    int i = findAddress(player);
+    if (i < 0) {
+        return player;
+    }
+    int8_t coordinator = topology.players[i].coordinator;
+    return coordinator < 0 ? player : IPAddress(topology.players[coordinator].addresses[0]);
+}
+
+uint8_t sonosTopologyCoordinators(IPAddress *coordinators, uint8_t max) {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < topology.count && count < max; i++) {
+        // Players we don't know the group of count as their own
+        int8_t coordinator = topology.players[i].coordinator;
+        if (coordinator == i || coordinator < 0) {
+            coordinators[count++] = IPAddress(topology.players[i].addresses[0]);
+        }
+    }
+    return count;
+}
+
+static boolean addMember(const ZoneGroupMember &member, void *data) {
+    if (!member.address) {
+        return true;
+    }
+    if (fresh.count >= SONOS_TOPOLOGY_MAX) {
+        Serial.printf("Too many players, not remembering %s\n", member.uuid);
+        return true;
+    }
+    TopologyPlayer *player = &fresh.players[fresh.count];
+    memset(player, 0, sizeof(*player));
+    strcpy(player->uuid, member.uuid);
+    player->addresses[0] = (uint32_t) member.address;
+    player->coordinator = -1;
+    strcpy(freshCoordinators[fresh.count], member.coordinator);
+
+    // Keep hold of where the player used to be in case it goes back there
+    int old = findPlayer(topology, member.uuid);
+    if (old >= 0) {
+        const uint32_t *oldAddresses = topology.players[old].addresses;
+        uint8_t next = 1;
+        for (uint8_t i = 0; i < SONOS_TOPOLOGY_ADDRESSES && next < SONOS_TOPOLOGY_ADDRESSES; i++) {
+            if (oldAddresses[i] != 0 && oldAddresses[i] != player->addresses[0]) {
+                player->addresses[next++] = oldAddresses[i];
+            }
+        }
+    }
+    fresh.count++;
+    return true;
+}
+
+// Who else to ask for the topology if host is slow to answer, every player knows all of it. host's coordinator
+// if it has another one, otherwise the first other player we know about
+static IPAddress topologyBackup(IPAddress host) {
+    IPAddress coordinator = sonosTopologyCoordinator(host);
+    if (coordinator != host) {
+        return coordinator;
+    }
+    for (uint8_t i = 0; i < topology.count; i++) {
+        if (topology.players[i].addresses[0] != (uint32_t) host) {
+            return IPAddress(topology.players[i].addresses[0]);
+        }
+    }
+    return IPAddress();
+}
+
+// Take the whole house from read rather than stopping at our player, we want the rest for failover. Returns false if
+// the document couldn't be read
+static boolean readTopology(XmlSource read, void *source) {
+    memset(&fresh, 0, sizeof(fresh));
+    if (!xmlZoneGroupMembers(read, source, addMember, NULL) || fresh.count == 0) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < fresh.count; i++) {
+        fresh.players[i].coordinator = findPlayer(fresh, freshCoordinators[i]);
+    }
+    fresh.hash = topologyHash(fresh);
+    if (fresh.hash != topology.hash) {
+        Serial.printf("Sonos topology changed, now %d players\n", fresh.count);
+        memcpy(&topology, &fresh, sizeof(topology));
+        saveTopology();
+    }
+    return true;
+}
+
+static int readConnection(void *source, char *buf, size_t len) {
+    return ((SonosConnection *) source)->read(buf, len);
+}
+
+boolean sonosTopologyUpdate(IPAddress host) {
+    MemoryScope memory(MEM_OP_TOPOLOGY);
+    EnergyScope radio(ENERGY_HTTP);
+    SonosConnection *conn;
+    int httpCode = sonosHedgedPost(host, topologyBackup(host), GET_ZONE_GROUP_STATE, &conn);
+    boolean complete = false;
+    if (httpCode == 200) {
+        complete = readTopology(readConnection, conn);
+    } else if (httpCode > 0) {
+        Serial.printf("Got bad status code getting zone topology %d: %s\n", httpCode, conn->body().c_str());
+    }
+    conn->finish();
+    return complete;
+}
+
+boolean sonosTopologyEvent(XmlSource read, void *source) {
+    MemoryScope memory(MEM_OP_TOPOLOGY);
+    return readTopology(read, source);
+}
+
+IPAddress sonosTopologyRefresh(IPAddress host, const char *uuid) {
+    if (!sonosTopologyUpdate(host)) {
+        return IPAddress();
+    }
+    return sonosTopologyAddress(uuid);
+}
+
+static boolean tryAddress(uint32_t address, const char *uuid, uint32_t *tried, uint8_t *triedCount, IPAddress *found) {
+    if (address == 0) {
+        return false;
+    }
+    for (uint8_t i = 0; i < *triedCount; i++) {
+        if (tried[i] == address) {
+            return false;
+        }
+    }
+    tried[(*triedCount)++] = address;
+
+    IPAddress host(address);
+    SonosConnection *conn = sonosConnection(host);
+    conn->setConnectTimeout(SONOS_TOPOLOGY_PROBE_TIMEOUT);
+    *found = sonosTopologyRefresh(host, uuid);
+    conn->setConnectTimeout(0);
+    if (*found) {
+        Serial.printf("Recovered %s at %s by asking %s\n", uuid, found->toString().c_str(), host.toString().c_str());
+        return true;
+    }
+    return false;
+}
+
+IPAddress sonosTopologyRecover(const char *uuid) {
+    IPAddress found;
+    // The address that just failed us counts as tried
+    uint32_t tried[SONOS_TOPOLOGY_MAX * SONOS_TOPOLOGY_ADDRESSES + 1];
+    uint8_t triedCount = 0;
+    int target = findPlayer(topology, uuid);
+    if (target < 0) {
+        return found;
+    }
+    // Copy what we're going to try, a successful refresh rewrites the map under us
+    TopologyPlayer player = topology.players[target];
+    uint32_t coordinator = player.coordinator >= 0 ? topology.players[player.coordinator].addresses[0] : 0;
+    tried[triedCount++] = player.addresses[0];
+
+    for (uint8_t i = 1; i < SONOS_TOPOLOGY_ADDRESSES; i++) {
+        if (tryAddress(player.addresses[i], uuid, tried, &triedCount, &found)) {
+            return found;
+        }
+    }
+    if (tryAddress(coordinator, uuid, tried, &triedCount, &found)) {
+        return found;
+    }
+    for (uint8_t i = 0; i < topology.count; i++) {
+        if (tryAddress(topology.players[i].addresses[0], uuid, tried, &triedCount, &found)) {
+            return found;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <Arduino.h>
+#include "sonos_xml.h"
+
+// Most players we remember, anything past this in a big household is dropped
+#define SONOS_TOPOLOGY_MAX 16
+// Addresses we remember for each player, the current one then the one it had before
+#define SONOS_TOPOLOGY_ADDRESSES 2
+// Connect timeout when probing addresses we only think are players, they may be gone entirely
+#define SONOS_TOPOLOGY_PROBE_TIMEOUT 300
+
+typedef struct {
+    char uuid[SONOS_UUID_LEN];
+    uint32_t addresses[SONOS_TOPOLOGY_ADDRESSES];
+    // Index of the coordinator of this player's group, -1 if we don't know it
+    int8_t coordinator;
+} TopologyPlayer;
+
+/**
+ * Every player in the household as of the last time we read the zone topology.
+ *
+ * The map is kept in RTC memory so it's there as soon as we wake up, and mirrored into flash
+ * (only when its hash changes) so it survives losing power. When the target player stops
+ * answering, the other addresses we know for it and the rest of the household get asked for
+ * the topology before we fall back to a multicast discovery, so a DHCP move costs a single
+ * round trip to a player that's still where we left it.
+ */
+typedef struct {
+    uint32_t hash;
+    uint8_t count;
+    TopologyPlayer players[SONOS_TOPOLOGY_MAX];
+} Topology;
+
+// Get the map from RTC memory, or flash if we've lost power since it was last written
+void sonosTopologyLoad();
+
+// The last known address of the player, or an empty address if we don't know it
+IPAddress sonosTopologyAddress(const char *uuid);
+
+// The last known address of the coordinator of player's group, player itself if we don't know any better
+IPAddress sonosTopologyCoordinator(IPAddress player);
+
+// Fill coordinators with the coordinator of every group in the household, up to max of them. Returns how many
+uint8_t sonosTopologyCoordinators(IPAddress *coordinators, uint8_t max);
+
+// Read the whole topology from any player at host and remember it, returns false if we couldn't. If host
+// is slow to answer another player gets asked too
+boolean sonosTopologyUpdate(IPAddress host);
+
+// Update the topology from host and return uuid's address in it
+IPAddress sonosTopologyRefresh(IPAddress host, const char *uuid);
+
+// uuid's current address isn't answering, ask everywhere else we know about for the topology
+IPAddress sonosTopologyRecover(const char *uuid);
+
+// Remember the topology a ZoneGroupTopology event brings, streamed in through read. Returns false if it couldn't be read
+boolean sonosTopologyEvent(XmlSource read, void *source);
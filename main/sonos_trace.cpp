@@ -0,0 +1,110 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <string.h>
+#include "sonos_trace.h"
+
+#define TRACE_MAGIC 0x54524143
+
+static const char *PHASE_NAMES[TRACE_PHASES] = {
+    "setup",
+    "wifi start",
+    "wifi connected",
+    "discovery start",
+    "discovery done",
+    "target found",
+    "command",
+    "operation start",
+    "operation done"
+};
+
+typedef struct {
+    boolean woke;
+    // Microseconds since boot, 0 if the phase wasn't reached
+    uint32_t stamps[TRACE_PHASES];
+} TraceCycle;
+
+static RTC_DATA_ATTR struct {
+    uint32_t magic;
+    uint8_t next;
+    uint8_t count;
+    TraceCycle cycles[TRACE_CYCLES];
+} trace;
+
+static TraceCycle *current = NULL;
+
+void traceBegin(boolean woke) {
+    if (trace.magic != TRACE_MAGIC || trace.next >= TRACE_CYCLES || trace.count > TRACE_CYCLES) {
+        memset(&trace, 0, sizeof(trace));
+        trace.magic = TRACE_MAGIC;
+    }
+    current = &trace.cycles[trace.next];
+    memset(current, 0, sizeof(*current));
+    current->woke = woke;
+    trace.next = (trace.next + 1) % TRACE_CYCLES;
+    if (trace.count < TRACE_CYCLES) {
+        trace.count++;
+    }
+    traceMark(TRACE_SETUP);
+}
+
+void traceMark(TracePhase phase) {
+    if (current != NULL && current->stamps[phase] == 0) {
+        uint32_t now = (uint32_t) esp_timer_get_time();
+        // 0 means not reached, so never store it
+        current->stamps[phase] = now == 0 ? 1 : now;
+    }
+}
+
+static int compareStamps(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// How long the phase took: from the latest phase stamped before it, or from boot
+static uint32_t phaseDuration(const TraceCycle &cycle, uint8_t phase) {
+    uint32_t end = cycle.stamps[phase];
+    uint32_t start = 0;
+    for (uint8_t i = 0; i < TRACE_PHASES; i++) {
+        if (cycle.stamps[i] != 0 && cycle.stamps[i] < end && cycle.stamps[i] > start) {
+            start = cycle.stamps[i];
+        }
+    }
+    return end - start;
+}
+
+static void printPercentiles(const char *name, uint32_t *values, uint8_t count) {
+    if (count == 0) {
+        Serial.printf("  %-16s     -\n", name);
+        return;
+    }
+    qsort(values, count, sizeof(uint32_t), compareStamps);
+    Serial.printf("  %-16s %3d %9.1f %9.1f %9.1f\n", name, count,
+        values[(count - 1) / 2] / 1000.0,
+        values[(count * 9 - 1) / 10] / 1000.0,
+        values[count - 1] / 1000.0);
+}
+
+void traceDump() {
+    uint32_t values[TRACE_CYCLES];
+    Serial.printf("Timings over the last %d wake cycles, ms from the phase before\n", trace.count);
+    Serial.printf("  %-16s %3s %9s %9s %9s\n", "phase", "n", "p50", "p90", "max");
+    for (uint8_t phase = 0; phase < TRACE_PHASES; phase++) {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < trace.count; i++) {
+            if (trace.cycles[i].stamps[phase] != 0) {
+                values[count++] = phaseDuration(trace.cycles[i], phase);
+            }
+        }
+        printPercentiles(PHASE_NAMES[phase], values, count);
+    }
+
+    // What we actually care about, from boot until the player has done what a wake up press asked for
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < trace.count; i++) {
+        if (trace.cycles[i].woke && trace.cycles[i].stamps[TRACE_OPERATION_DONE] != 0) {
+            values[count++] = trace.cycles[i].stamps[TRACE_OPERATION_DONE];
+        }
+    }
+    printPercentiles("wake to sound", values, count);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Arduino.h>
+
+// How many wake cycles we keep timings for
+#define TRACE_CYCLES 16
+
+// Phase boundaries we stamp, only the first time each is reached in a cycle counts
+typedef enum {
+    TRACE_SETUP,            // setup() started
+    TRACE_WIFI_START,       // connectWifi() started
+    TRACE_WIFI_CONNECTED,   // associated and got an address
+    TRACE_DISCOVERY_START,  // discoverSonos() started
+    TRACE_DISCOVERY_DONE,   // discoverSonos() finished, found or not
+    TRACE_TARGET_FOUND,     // the command task knows the player's address
+    TRACE_COMMAND,          // doSonos() started on the first command
+    TRACE_OPERATION_START,  // sonosOperation() started
+    TRACE_OPERATION_DONE,   // sonosOperation() finished
+    TRACE_PHASES
+} TracePhase;
+
+/**
+ * Wake to sound latency tracing.
+ *
+ * Each wake cycle gets a row of microsecond timestamps, taken from esp_timer so they count from
+ * boot (once the app is up, the bootloader isn't included). The last TRACE_CYCLES rows are kept in RTC memory so they survive deep sleep, and
+ * traceDump() prints percentiles of the time each phase took across them.
+ */
+
+// Start a new cycle, woke is whether a button woke us up
+void traceBegin(boolean woke);
+
+// Stamp the phase if it hasn't been reached yet this cycle
+void traceMark(TracePhase phase);
+
+// Print a summary of the cycles we've kept over serial
+void traceDump();
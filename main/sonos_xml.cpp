@@ -0,0 +1,230 @@
+#include <Arduino.h>
+#include <string.h>
+#include <expat.h>
+#include "sonos_connection.h"
+#include "sonos_xml.h"
+
+typedef struct {
+    XML_Parser parser;
+    const char *tagName;
+    char *value;
+    size_t len;
+    size_t pos;
+    boolean capturing;
+    boolean found;
+} TagCapture;
+
+typedef struct {
+    XML_Parser outer;
+    XML_Parser inner;
+    ZoneGroupMemberCallback callback;
+    void *data;
+    ZoneGroupMember member;
+    boolean inState;
+    // The callback had enough, or we got to the end of the inner document
+    boolean stopped;
+    boolean complete;
+} TopologyStream;
+
+// Created on first use and reset for each response after that
+static XML_Parser responseParser = NULL;
+// Second parser for documents escaped inside the response
+static XML_Parser innerParser = NULL;
+
+static XML_Parser resetParser(XML_Parser *parser) {
+    if (*parser == NULL) {
+        *parser = XML_ParserCreate(NULL);
+    } else if (!XML_ParserReset(*parser, NULL)) {
+        XML_ParserFree(*parser);
+        *parser = XML_ParserCreate(NULL);
+    }
+    if (*parser == NULL) {
+        Serial.println("Couldn't allocate parser");
+    }
+    return *parser;
+}
+
+const char *xmlLocalName(const char *el) {
+    const char *colon = strchr(el, ':');
+    return colon == NULL ? el : colon + 1;
+}
+
+const char *xmlAttrValue(const char **attr, const char *name) {
+    for (int i = 0; attr[i] != NULL && attr[i + 1] != NULL; i += 2) {
+        if (strcmp(attr[i], name) == 0) {
+            return attr[i + 1];
+        }
+    }
+    return NULL;
+}
+
+static void captureStart(void *data, const char *el, const char **attr) {
+    TagCapture *capture = (TagCapture *) data;
+    if (strcmp(xmlLocalName(el), capture->tagName) == 0) {
+        capture->capturing = true;
+    }
+}
+
+static void captureEnd(void *data, const char *el) {
+    TagCapture *capture = (TagCapture *) data;
+    if (capture->capturing) {
+        // That's everything we wanted, don't bother with the rest of the document
+        capture->capturing = false;
+        capture->found = true;
+        XML_StopParser(capture->parser, false);
+    }
+}
+
+static void captureData(void *data, const char *s, int len) {
+    TagCapture *capture = (TagCapture *) data;
+    if (capture->capturing) {
+        size_t room = capture->len - 1 - capture->pos;
+        size_t count = (size_t) len < room ? len : room;
+        memcpy(capture->value + capture->pos, s, count);
+        capture->pos += count;
+        capture->value[capture->pos] = '\0';
+    }
+}
+
+int xmlTagValue(SonosConnection *conn, const char *tagName, char *value, size_t len) {
+    value[0] = '\0';
+    if (resetParser(&responseParser) == NULL) {
+        return -1;
+    }
+
+    TagCapture capture = { responseParser, tagName, value, len, 0, false, false };
+    XML_SetUserData(responseParser, &capture);
+    XML_SetElementHandler(responseParser, captureStart, captureEnd);
+    XML_SetCharacterDataHandler(responseParser, captureData);
+
+    char buf[128];
+    while (!capture.found) {
+        int count = conn->read(buf, sizeof(buf));
+        if (count <= 0) {
+            break;
+        }
+        if (XML_Parse(responseParser, buf, count, false) == XML_STATUS_ERROR) {
+            // Includes the parser being stopped once we found the value
+            break;
+        }
+    }
+    return capture.found ? (int) capture.pos : -1;
+}
+
+static void copyAttr(char *dest, size_t len, const char *value) {
+    if (value == NULL) {
+        dest[0] = '\0';
+    } else {
+        strncpy(dest, value, len - 1);
+        dest[len - 1] = '\0';
+    }
+}
+
+/*
+ * The inner document looks like this, with the coordinator's UUID on each group:
+ *   <ZoneGroups>
+ *     <ZoneGroup Coordinator="RINCON_XXXX01400" ID="RINCON_XXXX01400:58">
+ *       <ZoneGroupMember UUID="RINCON_XXXX01400" Location="http://192.168.1.20:1400/xml/device_description.xml" .../>
+ *       ...
+ *     </ZoneGroup>
+ *   </ZoneGroups>
+ */
+static void topologyStart(void *data, const char *el, const char **attr) {
+    TopologyStream *stream = (TopologyStream *) data;
+    const char *name = xmlLocalName(el);
+    if (strcmp(name, "ZoneGroup") == 0) {
+        copyAttr(stream->member.coordinator, sizeof(stream->member.coordinator), xmlAttrValue(attr, "Coordinator"));
+    } else if (strcmp(name, "ZoneGroupMember") == 0) {
+        const char *uuid = xmlAttrValue(attr, "UUID");
+        const char *location = xmlAttrValue(attr, "Location");
+        // http://192.168.1.20:1400/xml/device_description.xml
+        if (uuid == NULL || location == NULL || strncmp(location, "http://", 7) != 0) {
+            return;
+        }
+        char host[16];
+        size_t hostLen = strcspn(location + 7, ":/");
+        if (hostLen >= sizeof(host)) {
+            return;
+        }
+        memcpy(host, location + 7, hostLen);
+        host[hostLen] = '\0';
+
+        copyAttr(stream->member.uuid, sizeof(stream->member.uuid), uuid);
+        stream->member.address = IPAddress();
+        stream->member.address.fromString(host);
+        if (!stream->callback(stream->member, stream->data)) {
+            stream->stopped = true;
+            XML_StopParser(stream->inner, false);
+            // We're inside the outer parser's character data handler, so it can be stopped from here too
+            XML_StopParser(stream->outer, false);
+        }
+    }
+}
+
+static void responseStart(void *data, const char *el, const char **attr) {
+    TopologyStream *stream = (TopologyStream *) data;
+    if (strcmp(xmlLocalName(el), "ZoneGroupState") == 0 && resetParser(&innerParser) != NULL) {
+        stream->inner = innerParser;
+        stream->inState = true;
+        XML_SetUserData(stream->inner, stream);
+        XML_SetElementHandler(stream->inner, topologyStart, NULL);
+    }
+}
+
+static void responseEnd(void *data, const char *el) {
+    TopologyStream *stream = (TopologyStream *) data;
+    if (stream->inState) {
+        stream->inState = false;
+        stream->complete = XML_Parse(stream->inner, "", 0, true) != XML_STATUS_ERROR;
+        XML_StopParser(stream->outer, false);
+    }
+}
+
+// expat hands us the unescaped inner document a piece at a time, which goes straight into the inner parser
+static void responseData(void *data, const char *s, int len) {
+    TopologyStream *stream = (TopologyStream *) data;
+    if (stream->inState && XML_Parse(stream->inner, s, len, false) == XML_STATUS_ERROR) {
+        stream->inState = false;
+        XML_StopParser(stream->outer, false);
+    }
+}
+
+static int readConnection(void *source, char *buf, size_t len) {
+    return ((SonosConnection *) source)->read(buf, len);
+}
+
+boolean xmlZoneGroupMembers(SonosConnection *conn, ZoneGroupMemberCallback callback, void *data) {
+    return xmlZoneGroupMembers(readConnection, conn, callback, data);
+}
+
+boolean xmlZoneGroupMembers(XmlSource read, void *source, ZoneGroupMemberCallback callback, void *data) {
+    if (resetParser(&responseParser) == NULL) {
+        return false;
+    }
+    TopologyStream stream;
+    stream.outer = responseParser;
+    stream.inner = NULL;
+    stream.callback = callback;
+    stream.data = data;
+    stream.member.uuid[0] = '\0';
+    stream.member.coordinator[0] = '\0';
+    stream.inState = false;
+    stream.stopped = false;
+    stream.complete = false;
+    XML_SetUserData(responseParser, &stream);
+    XML_SetElementHandler(responseParser, responseStart, responseEnd);
+    XML_SetCharacterDataHandler(responseParser, responseData);
+
+    char buf[128];
+    for (;;) {
+        int count = read(source, buf, sizeof(buf));
+        if (count <= 0) {
+            break;
+        }
+        if (XML_Parse(responseParser, buf, count, false) == XML_STATUS_ERROR) {
+            // Includes stopping once the inner document ended or the callback had enough
+            break;
+        }
+    }
+    return stream.stopped || stream.complete;
+}
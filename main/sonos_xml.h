@@ -0,0 +1,48 @@
+#pragma once
+
+#include <Arduino.h>
+#include "sonos_connection.h"
+
+/**
+ * Streaming extraction of values from the XML responses the players send us.
+ *
+ * The response body is fed from the socket into a single parser that gets reset and reused for
+ * every call, so nothing is copied into a string first and no parser is allocated per request.
+ * Parsing stops as soon as the value we want has been captured, finish() on the connection throws
+ * away whatever is left.
+ */
+
+// Stream the response body on conn until the text of the first element named tagName (ignoring
+// any namespace prefix) has been captured into value. Returns its length, or -1 if it wasn't found.
+int xmlTagValue(SonosConnection *conn, const char *tagName, char *value, size_t len);
+
+// Longest player UUID we keep, they look like RINCON_000E58XXXXXXXX01400
+#define SONOS_UUID_LEN 40
+
+typedef struct {
+    char uuid[SONOS_UUID_LEN];
+    IPAddress address;
+    // UUID of the coordinator of the group the player is in, which may be the player itself
+    char coordinator[SONOS_UUID_LEN];
+} ZoneGroupMember;
+
+// Called for each player as the topology streams in, return false once you've seen enough
+typedef boolean (*ZoneGroupMemberCallback)(const ZoneGroupMember &member, void *data);
+
+// Where a document comes from a piece at a time. Puts up to len bytes in buf and returns how many,
+// 0 at the end or a negative error
+typedef int (*XmlSource)(void *source, char *buf, size_t len);
+
+// Stream a GetZoneGroupState response on conn, decoding the ZoneGroupState document escaped
+// inside it on the fly and handing each ZoneGroupMember to callback. Nothing but the member
+// being reported is kept around, however big the household is. Stops reading as soon as the
+// callback returns false. Returns false if the response couldn't be read or parsed.
+boolean xmlZoneGroupMembers(SonosConnection *conn, ZoneGroupMemberCallback callback, void *data);
+// The same for any document with a ZoneGroupState element in it, like a topology event
+boolean xmlZoneGroupMembers(XmlSource read, void *source, ZoneGroupMemberCallback callback, void *data);
+
+// Element name without any namespace prefix
+const char *xmlLocalName(const char *el);
+
+// Value of the named attribute from an expat attribute list, or NULL
+const char *xmlAttrValue(const char **attr, const char *name);
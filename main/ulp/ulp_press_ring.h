@@ -0,0 +1,7 @@
+// Shared between the ULP program and the main CPU, so only #defines in here
+
+// How many presses the ULP can hold until the main CPU takes them, must be a power of two
+#define ULP_PRESS_RING_SIZE 8
+// Presses are stamped with 16 bits of the RTC slow clock starting at this bit, about 7ms a tick and
+// wrapping after about 7 minutes, plenty for the time it takes to boot and join wifi
+#define ULP_STAMP_SHIFT 10